@@ -0,0 +1,552 @@
+#define MODULE_OWNERSHIP
+#include "psfs.h"
+#include<linux/buffer_head.h>
+#include<linux/vmalloc.h>
+#include<linux/log2.h>
+#include<linux/sort.h>
+#include<linux/reciprocal_div.h>
+#include<asm/unaligned.h>
+#include<trace/events/psfs.h>
+
+/*
+ * Name lookup in a directory.
+ *
+ * Directories are a plain stream of entries on disk. They are read once
+ * into a psfs_dcache hung off the inode, by the first lookup or readdir,
+ * and answered from memory after that. Up to PSFS_DCACHE_MAX_BLOCKS
+ * blocks the cache holds the names themselves; past that only the hash
+ * of each name and the block it is in, so a lookup reads one block
+ * instead of scanning them all. Directories over PSFS_DINDEX_MAX_BLOCKS
+ * and ones whose cache can't be allocated are scanned linearly. Anything
+ * changing a directory's entries must call psfs_dcache_drop. The caches
+ * sit on one global list and a shrinker frees the ones not used lately.
+ */
+#define PSFS_DCACHE_MAX_BLOCKS	64
+#define PSFS_DINDEX_MAX_BLOCKS	4096
+#define PSFS_DCACHE_MIN_SLOTS	16
+#define PSFS_DIR_RA_BLOCKS	16
+#define PSFS_PREFETCH_BATCH	32
+
+static LIST_HEAD(psfs_dcache_list);
+static DEFINE_SPINLOCK(psfs_dcache_lock);
+static int psfs_dcache_nr;
+
+/*
+ * Called for each in use entry of a directory block with a pointer to the
+ * on-disk entry. A non zero return stops the walk and is passed on.
+ */
+typedef int (*psfs_dirent_actor)(void *priv,const char *de,__u8 name_len);
+
+static struct buffer_head *psfs_dir_bread(struct inode *dir,__u64 lblk)
+{
+	unsigned long mapped;
+	sector_t phys;
+
+	if (psfs_map_block(dir,lblk,&phys,&mapped) <= 0)
+		return NULL;
+	return psfs_meta_bread(dir->i_sb,phys);
+}
+
+/*
+ * Bytes of directory block @lblk that hold entries.
+ */
+static unsigned int psfs_dir_block_len(struct inode *dir,__u64 lblk)
+{
+	loff_t off = (loff_t)lblk << dir->i_sb->s_blocksize_bits;
+	loff_t size = i_size_read(dir);
+
+	if (off >= size)
+		return 0;
+	return min_t(loff_t,size - off,dir->i_sb->s_blocksize);
+}
+
+/*
+ * Feed the entries of one directory block to @actor.
+ *
+ * Returns what the actor stopped with, 0 at the end of the block or -EIO
+ * for a broken block.
+ */
+static int psfs_walk_block(struct super_block *sb,const char *data,
+				unsigned int len,psfs_dirent_actor actor,
+				void *priv)
+{
+	unsigned int off = 0;
+	int ret;
+
+	while (off + PSFS_MIN_DIRENT_SIZE <= len) {
+		const char *de = data + off;
+		__u16 rec_len = get_unaligned_be16(de + offsetof(struct psfs_dir_entry,rec_len));
+		__u8 name_len = de[offsetof(struct psfs_dir_entry,name_len)];
+
+		/*Zeroed tail of a block that isn't full.*/
+		if (!rec_len)
+			break;
+		if (rec_len < PSFS_MIN_DIRENT_SIZE + name_len ||
+			off + rec_len > len)
+			return -EIO;
+		psfs_stat_inc(PSFS_SB(sb),PSFS_STAT_DIRENTS_SCANNED);
+		if (name_len && (ret = actor(priv,de,name_len)))
+			return ret;
+		off += rec_len;
+	}
+	return 0;
+}
+
+/*
+ * Feed all entries of @dir to @actor. If @cur isn't NULL it's set to the
+ * block being walked.
+ */
+static int psfs_walk_dir(struct inode *dir,psfs_dirent_actor actor,void *priv,
+				__u64 *cur)
+{
+	__u64 lblk;
+	unsigned int len;
+	int ret = 0;
+
+	for (lblk = 0;!ret && (len = psfs_dir_block_len(dir,lblk));lblk++) {
+		struct buffer_head *bh = psfs_dir_bread(dir,lblk);
+		if (!bh)
+			return -EIO;
+		if (cur)
+			*cur = lblk;
+		ret = psfs_walk_block(dir->i_sb,bh->b_data,len,actor,priv);
+		brelse(bh);
+	}
+	return ret;
+}
+
+struct psfs_match {
+	const struct qstr *name;
+	__u32 *ino;
+};
+
+static int psfs_match_actor(void *priv,const char *de,__u8 name_len)
+{
+	struct psfs_match *m = priv;
+	if (name_len != m->name->len ||
+		memcmp(de + PSFS_MIN_DIRENT_SIZE,m->name->name,name_len))
+		return 0;
+	*m->ino = get_unaligned_be32(de + offsetof(struct psfs_dir_entry,inode_nr));
+	return 1;
+}
+
+static int psfs_linear_lookup(struct inode *dir,const struct qstr *name,
+				__u32 *ino)
+{
+	struct psfs_match m = {name,ino};
+	return psfs_walk_dir(dir,psfs_match_actor,&m,NULL);
+}
+
+/*
+ * Search directory block @lblk for @name.
+ */
+static int psfs_block_lookup(struct inode *dir,__u64 lblk,
+				const struct qstr *name,__u32 *ino)
+{
+	struct psfs_match m = {name,ino};
+	struct buffer_head *bh = psfs_dir_bread(dir,lblk);
+	int ret;
+
+	if (!bh)
+		return -EIO;
+	ret = psfs_walk_block(dir->i_sb,bh->b_data,psfs_dir_block_len(dir,lblk),
+				psfs_match_actor,&m);
+	brelse(bh);
+	return ret;
+}
+
+/*
+ * Building a psfs_dcache: one walk to size it, one to fill it.
+ */
+struct psfs_dcache_fill {
+	struct psfs_dcache *dc;
+	__u32 nr;
+	__u32 bytes;
+	__u32 max_bytes;
+	int counting;
+	__u64 lblk;
+};
+
+static int psfs_dcache_fill_actor(void *priv,const char *de,__u8 name_len)
+{
+	struct psfs_dcache_fill *f = priv;
+	struct psfs_dcache *dc = f->dc;
+	struct psfs_dcache_ent *ent;
+	__u32 hash,i;
+
+	if (f->counting) {
+		f->nr++;
+		f->bytes += name_len;
+		return 0;
+	}
+	/*Only if the directory changed under us, which it can't.*/
+	if (!dc->index && f->bytes + name_len > f->max_bytes)
+		return -EIO;
+	hash = psfs_name_hash((const unsigned char *)de + PSFS_MIN_DIRENT_SIZE,
+				name_len);
+	for (i = hash & dc->mask;dc->slots[i].name_len;i = (i + 1) & dc->mask)
+		;
+	ent = &dc->slots[i];
+	ent->hash = hash;
+	ent->ino = get_unaligned_be32(de + offsetof(struct psfs_dir_entry,inode_nr));
+	ent->flags = get_unaligned_be16(de + offsetof(struct psfs_dir_entry,flags));
+	ent->name_len = name_len;
+	if (dc->index) {
+		ent->lblk = f->lblk;
+		return 0;
+	}
+	ent->name_off = f->bytes;
+	memcpy(dc->names + f->bytes,de + PSFS_MIN_DIRENT_SIZE,name_len);
+	f->bytes += name_len;
+	return 0;
+}
+
+static void psfs_dcache_free(struct psfs_dcache *dc)
+{
+	if (is_vmalloc_addr(dc))
+		vfree(dc);
+	else
+		kfree(dc);
+}
+
+/*
+ * Make sure dir has its names cached. Caller holds dir->i_mutex.
+ *
+ * Returns 0 if PSFS_I(dir)->dcache can be used, negative if the
+ * directory isn't cached (too big, out of memory, I/O error).
+ */
+int psfs_dcache_get(struct inode *dir)
+{
+	struct psfs_inode_info *psi = PSFS_I(dir);
+	struct psfs_dcache_fill f = {NULL,0,0,0,1,0};
+	struct psfs_dcache *dc;
+	__u32 nr_slots;
+	size_t size;
+	int ret,index;
+
+	if (psi->dcache) {
+		psi->dcache->referenced = 1;
+		return 0;
+	}
+	if (i_size_read(dir) > ((loff_t)PSFS_DINDEX_MAX_BLOCKS << dir->i_blkbits))
+		return -EFBIG;
+	index = i_size_read(dir) > (PSFS_DCACHE_MAX_BLOCKS << dir->i_blkbits);
+	ret = psfs_walk_dir(dir,psfs_dcache_fill_actor,&f,NULL);
+	if (ret)
+		return ret;
+
+	nr_slots = max_t(__u32,roundup_pow_of_two(f.nr * 2),
+				PSFS_DCACHE_MIN_SLOTS);
+	size = sizeof(*dc) + nr_slots * sizeof(struct psfs_dcache_ent) +
+		(index ? 0 : f.bytes);
+	if (size <= PAGE_SIZE)
+		dc = kzalloc(size,GFP_NOFS);
+	else {
+		dc = vmalloc(size);
+		if (dc)
+			memset(dc,0,size);
+	}
+	if (!dc)
+		return -ENOMEM;
+	dc->psi = psi;
+	dc->index = index;
+	dc->mask = nr_slots - 1;
+	dc->slots = (struct psfs_dcache_ent *)(dc + 1);
+	dc->names = (char *)(dc->slots + nr_slots);
+	f.dc = dc;
+	f.counting = 0;
+	f.max_bytes = f.bytes;
+	f.bytes = 0;
+	ret = psfs_walk_dir(dir,psfs_dcache_fill_actor,&f,&f.lblk);
+	if (ret) {
+		psfs_dcache_free(dc);
+		return ret < 0 ? ret : -EIO;
+	}
+
+	spin_lock(&psfs_dcache_lock);
+	list_add(&dc->lru,&psfs_dcache_list);
+	psfs_dcache_nr++;
+	psi->dcache = dc;
+	spin_unlock(&psfs_dcache_lock);
+	return 0;
+}
+
+/*
+ * Look @name up in a directory's cache. An index only narrows it down
+ * to the blocks that may hold the name, those are then searched.
+ */
+static int psfs_dcache_lookup(struct psfs_dcache *dc,const struct qstr *name,
+				__u32 *ino)
+{
+	__u32 hash = psfs_name_hash(name->name,name->len);
+	__u32 i;
+	int ret;
+
+	for (i = hash & dc->mask;dc->slots[i].name_len;i = (i + 1) & dc->mask) {
+		struct psfs_dcache_ent *ent = &dc->slots[i];
+		if (ent->hash != hash || ent->name_len != name->len)
+			continue;
+		if (dc->index) {
+			ret = psfs_block_lookup(&dc->psi->vfs_inode,ent->lblk,
+						name,ino);
+			if (ret)
+				return ret;
+			continue;
+		}
+		if (!memcmp(dc->names + ent->name_off,name->name,name->len)) {
+			*ino = ent->ino;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Throw away a directory's cached names. Whoever takes the cache off the
+ * inode under psfs_dcache_lock frees it, so this and the shrinker never
+ * free the same one.
+ */
+void psfs_dcache_drop(struct psfs_inode_info *psi)
+{
+	struct psfs_dcache *dc;
+
+	spin_lock(&psfs_dcache_lock);
+	dc = psi->dcache;
+	if (dc) {
+		list_del(&dc->lru);
+		psfs_dcache_nr--;
+		psi->dcache = NULL;
+	}
+	spin_unlock(&psfs_dcache_lock);
+	if (dc)
+		psfs_dcache_free(dc);
+}
+
+/*
+ * Free caches from the cold end of the list. Caches used since the last
+ * pass get a second chance, ones whose directory is busy are skipped;
+ * i_mutex is what keeps a lookup from seeing its cache freed.
+ */
+static int psfs_dcache_shrink(struct shrinker *shrink,int nr_to_scan,
+				gfp_t gfp_mask)
+{
+	struct psfs_dcache *dc,*next;
+	LIST_HEAD(victims);
+
+	if (nr_to_scan) {
+		if (!(gfp_mask & __GFP_FS))
+			return -1;
+		spin_lock(&psfs_dcache_lock);
+		while (nr_to_scan-- && !list_empty(&psfs_dcache_list)) {
+			struct inode *dir;
+			dc = list_entry(psfs_dcache_list.prev,struct psfs_dcache,lru);
+			dir = &dc->psi->vfs_inode;
+			if (dc->referenced || !mutex_trylock(&dir->i_mutex)) {
+				dc->referenced = 0;
+				list_move(&dc->lru,&psfs_dcache_list);
+				continue;
+			}
+			dc->psi->dcache = NULL;
+			list_move(&dc->lru,&victims);
+			psfs_dcache_nr--;
+			mutex_unlock(&dir->i_mutex);
+		}
+		spin_unlock(&psfs_dcache_lock);
+		list_for_each_entry_safe(dc,next,&victims,lru)
+			psfs_dcache_free(dc);
+	}
+	return psfs_dcache_nr;
+}
+
+static struct shrinker psfs_dcache_shrinker = {
+	.shrink = psfs_dcache_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+void psfs_dcache_init(void)
+{
+	register_shrinker(&psfs_dcache_shrinker);
+}
+
+void psfs_dcache_exit(void)
+{
+	unregister_shrinker(&psfs_dcache_shrinker);
+}
+
+static unsigned char psfs_dt_type(__u16 flags)
+{
+	if (flags & PSFS_DIR)
+		return DT_DIR;
+	if (flags & PSFS_LNK)
+		return DT_LNK;
+	if (flags & PSFS_REG)
+		return DT_REG;
+	return DT_UNKNOWN;
+}
+
+/*
+ * State of one psfs_readdir call. The inode table blocks of the entries
+ * handed out are collected in blocks[] and read ahead in batches, sorted,
+ * so the stat() storm following a listing finds them in the cache.
+ */
+struct psfs_readdir_ctx {
+	void *dirent;
+	filldir_t filldir;
+	int nr;
+	sector_t blocks[PSFS_PREFETCH_BATCH];
+};
+
+static int psfs_cmp_sector(const void *a,const void *b)
+{
+	sector_t x = *(const sector_t *)a,y = *(const sector_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void psfs_prefetch_inodes(struct super_block *sb,
+				struct psfs_readdir_ctx *ctx)
+{
+	int i;
+
+	sort(ctx->blocks,ctx->nr,sizeof(sector_t),psfs_cmp_sector,NULL);
+	for (i = 0;i < ctx->nr;i++)
+		if (!i || ctx->blocks[i] != ctx->blocks[i - 1])
+			psfs_meta_breadahead(sb,ctx->blocks[i]);
+	ctx->nr = 0;
+}
+
+static void psfs_queue_inode(struct super_block *sb,
+				struct psfs_readdir_ctx *ctx,__u32 ino)
+{
+	struct psfs_sb_info *psbi = PSFS_SB(sb);
+	sector_t block;
+
+	if (ino >= psbi->s_ps->psfs_nr_inodes)
+		return;
+	block = psbi->inode_table_block + psfs_ino_to_block(psbi,ino,NULL);
+	/*Entries created together mostly share a table block.*/
+	if (ctx->nr && ctx->blocks[ctx->nr - 1] == block)
+		return;
+	ctx->blocks[ctx->nr++] = block;
+	if (ctx->nr == PSFS_PREFETCH_BATCH)
+		psfs_prefetch_inodes(sb,ctx);
+}
+
+/*
+ * Hand the entries of a directory block from byte @off on to filldir,
+ * straight from the buffer. f_pos follows the entries. An entry running
+ * past the end of the block is corruption, not something to stop at.
+ *
+ * Returns 1 when filldir is full, 0 at the end of the block, -EIO.
+ */
+static int psfs_readdir_block(struct file *file,const char *data,
+				unsigned int off,unsigned int len,
+				struct psfs_readdir_ctx *ctx)
+{
+	struct super_block *sb = file->f_dentry->d_inode->i_sb;
+
+	while (off + PSFS_MIN_DIRENT_SIZE <= len) {
+		const char *de = data + off;
+		__u16 rec_len = get_unaligned_be16(de + offsetof(struct psfs_dir_entry,rec_len));
+		__u8 name_len = de[offsetof(struct psfs_dir_entry,name_len)];
+		__u32 ino;
+
+		if (!rec_len)
+			break;
+		if (rec_len < PSFS_MIN_DIRENT_SIZE + name_len ||
+			off + rec_len > len)
+			return -EIO;
+		psfs_stat_inc(PSFS_SB(sb),PSFS_STAT_DIRENTS_SCANNED);
+		if (name_len) {
+			ino = get_unaligned_be32(de + offsetof(struct psfs_dir_entry,inode_nr));
+			if (ctx->filldir(ctx->dirent,de + PSFS_MIN_DIRENT_SIZE,
+					name_len,file->f_pos,ino,
+					psfs_dt_type(get_unaligned_be16(de + offsetof(struct psfs_dir_entry,flags)))))
+				return 1;
+			psfs_queue_inode(sb,ctx,ino);
+		}
+		off += rec_len;
+		file->f_pos += rec_len;
+	}
+	return 0;
+}
+
+/*
+ * f_pos is the byte offset of the next entry in the directory. Entries
+ * don't cross blocks, what's left at the end of a block is skipped.
+ *
+ * Walks as many blocks as filldir takes. The extent is looked up once
+ * and then followed block by block, with readahead kept up to
+ * PSFS_DIR_RA_BLOCKS ahead of us within it so a big directory streams
+ * in rather than being read one synchronous block at a time.
+ */
+int psfs_readdir(struct file *file,void *dirent,filldir_t filldir)
+{
+	struct inode *dir = file->f_dentry->d_inode;
+	struct super_block *sb = dir->i_sb;
+	struct psfs_readdir_ctx ctx;
+	unsigned long mapped = 0;
+	sector_t phys = 0,ra_next = 0;
+	__u64 start = psfs_trace_clock(psfs_readdir_exit);
+	int ret = 0;
+
+	PSFS_DBG(PSFS_DEBUG_READDIR,"psfs: readdir %lu at %lld\n",dir->i_ino,
+		file->f_pos);
+	trace_psfs_readdir_enter(dir,file->f_pos);
+	/*Prime the name cache, the lookups usually follow right after.*/
+	if (!file->f_pos && file->f_pos < i_size_read(dir))
+		psfs_dcache_get(dir);
+	ctx.dirent = dirent;
+	ctx.filldir = filldir;
+	ctx.nr = 0;
+	while (file->f_pos < i_size_read(dir)) {
+		__u64 lblk = file->f_pos >> dir->i_blkbits;
+		struct buffer_head *bh;
+
+		if (!mapped) {
+			ret = psfs_map_block(dir,lblk,&phys,&mapped);
+			if (ret <= 0) {
+				ret = ret ? ret : -EIO;
+				break;
+			}
+			ra_next = phys + 1;
+		}
+		while (ra_next < phys + min_t(unsigned long,mapped,
+						PSFS_DIR_RA_BLOCKS))
+			psfs_meta_breadahead(sb,ra_next++);
+		bh = psfs_meta_bread(sb,phys);
+		if (!bh) {
+			ret = -EIO;
+			break;
+		}
+		ret = psfs_readdir_block(file,bh->b_data,
+				file->f_pos & (sb->s_blocksize - 1),
+				psfs_dir_block_len(dir,lblk),&ctx);
+		brelse(bh);
+		if (ret)
+			break;
+		file->f_pos = (lblk + 1) << dir->i_blkbits;
+		phys++;
+		mapped--;
+	}
+	if (ctx.nr)
+		psfs_prefetch_inodes(sb,&ctx);
+	trace_psfs_readdir_exit(dir,file->f_pos,ret,psfs_trace_delta(start));
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * Find @name in @dir.
+ *
+ * Returns 1 and sets *ino if found, 0 if there's no such entry, negative
+ * on error.
+ */
+int psfs_find_entry(struct inode *dir,const struct qstr *name,__u32 *ino)
+{
+	struct psfs_inode_info *psi = PSFS_I(dir);
+
+	if (!psfs_dcache_get(dir)) {
+		psfs_stat_inc(PSFS_SB(dir->i_sb),PSFS_STAT_DCACHE_HITS);
+		return psfs_dcache_lookup(psi->dcache,name,ino);
+	}
+	return psfs_linear_lookup(dir,name,ino);
+}
@@ -0,0 +1,465 @@
+#define MODULE_OWNERSHIP
+#include "psfs.h"
+#include<linux/buffer_head.h>
+#include<trace/events/psfs.h>
+
+/*
+ * In memory index of the free extents of the data bitmap.
+ *
+ * Every free run of blocks in a group is kept in two rbtrees of that group,
+ * one ordered by the starting block so neighbours can be merged on free, the
+ * other ordered by length (then start) so an allocation can pick the best
+ * fitting run in O(log n). The index is built once at mount by scanning the
+ * data bitmap. Runs never cross a group boundary.
+ *
+ * The index only decides where an extent goes. psfs_alloc_blocks and
+ * psfs_free_blocks keep the on-disk bitmap in step with it.
+ */
+
+static void psfs_free_insert_start(struct rb_root *root,
+				struct psfs_free_extent *fe)
+{
+	struct rb_node **p = &root->rb_node,*parent = NULL;
+	while (*p) {
+		struct psfs_free_extent *cur;
+		parent = *p;
+		cur = rb_entry(parent,struct psfs_free_extent,by_start);
+		if (fe->start < cur->start)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&fe->by_start,parent,p);
+	rb_insert_color(&fe->by_start,root);
+}
+
+static void psfs_free_insert_len(struct rb_root *root,
+				struct psfs_free_extent *fe)
+{
+	struct rb_node **p = &root->rb_node,*parent = NULL;
+	while (*p) {
+		struct psfs_free_extent *cur;
+		parent = *p;
+		cur = rb_entry(parent,struct psfs_free_extent,by_len);
+		if (fe->len < cur->len ||
+			(fe->len == cur->len && fe->start < cur->start))
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&fe->by_len,parent,p);
+	rb_insert_color(&fe->by_len,root);
+}
+
+static void psfs_free_insert(struct psfs_group_info *grp,
+				struct psfs_free_extent *fe)
+{
+	psfs_free_insert_start(&grp->free_by_start,fe);
+	psfs_free_insert_len(&grp->free_by_len,fe);
+	grp->free_blocks += fe->len;
+}
+
+static void psfs_free_erase(struct psfs_group_info *grp,
+				struct psfs_free_extent *fe)
+{
+	rb_erase(&fe->by_start,&grp->free_by_start);
+	rb_erase(&fe->by_len,&grp->free_by_len);
+	grp->free_blocks -= fe->len;
+}
+
+/*
+ *Smallest free extent which is at least nr_blocks long, NULL if none.
+ */
+static struct psfs_free_extent *psfs_free_best_fit(struct psfs_group_info *grp,
+							__u64 nr_blocks)
+{
+	struct rb_node *n = grp->free_by_len.rb_node;
+	struct psfs_free_extent *best = NULL;
+	while (n) {
+		struct psfs_free_extent *cur;
+		cur = rb_entry(n,struct psfs_free_extent,by_len);
+		if (cur->len >= nr_blocks) {
+			best = cur;
+			n = n->rb_left;
+		}
+		else
+			n = n->rb_right;
+	}
+	return best;
+}
+
+/*
+ *Add a free run found while scanning the bitmap at mount.
+ */
+static int psfs_free_index_add(struct psfs_group_info *grp,__u64 start,__u64 len)
+{
+	struct psfs_free_extent *fe;
+	if (!len)
+		return 0;
+	fe = kmalloc(sizeof(*fe),GFP_KERNEL);
+	if (!fe)
+		return -ENOMEM;
+	fe->start = start;
+	fe->len = len;
+	psfs_free_insert(grp,fe);
+	return 0;
+}
+
+/*
+ * Scan a group's slice of the data bitmap and build its free extent index.
+ * Runs crossing bitmap block boundaries are carried over to the next block.
+ */
+static int psfs_build_group_index(struct super_block *sb,
+					struct psfs_group_info *grp)
+{
+	struct psfs_sb_info *psbi = PSFS_SB(sb);
+	__u64 bits_per_block = 1ULL << psbi->bits_per_block_shift;
+	__u64 nr_bmap_blocks = (grp->nr_blocks + psbi->bits_per_block_mask) >>
+					psbi->bits_per_block_shift;
+	__u64 run_start = 0,run_len = 0;
+	__u64 i;
+	int err;
+
+	for (i = 0;i < nr_bmap_blocks;i++) {
+		struct buffer_head *bh;
+		__u64 base = grp->first_block + i * bits_per_block;
+		__u64 nbits = grp->first_block + grp->nr_blocks - base;
+		__u64 bit = 0,end;
+
+		if (nbits > bits_per_block)
+			nbits = bits_per_block;
+		if (i + 1 < nr_bmap_blocks)
+			sb_breadahead(sb,grp->block_bitmap + i + 1);
+		bh = sb_bread(sb,grp->block_bitmap + i);
+		if (!bh)
+			return -EIO;
+		while (bit < nbits) {
+			bit = psfs_find_next_zero_bit((unsigned char *)bh->b_data,
+							nbits,bit);
+			if (bit >= nbits)
+				break;
+			end = psfs_find_next_bit((unsigned char *)bh->b_data,
+							nbits,bit);
+			if (run_len && run_start + run_len == base + bit)
+				run_len += end - bit;
+			else {
+				err = psfs_free_index_add(grp,run_start,run_len);
+				if (err) {
+					brelse(bh);
+					return err;
+				}
+				run_start = base + bit;
+				run_len = end - bit;
+			}
+			bit = end;
+		}
+		brelse(bh);
+	}
+	return psfs_free_index_add(grp,run_start,run_len);
+}
+
+/*
+ * Build the free extent index of every group. Must be called after
+ * psfs_load_groups.
+ */
+int psfs_build_free_index(struct super_block *sb)
+{
+	struct psfs_sb_info *psbi = PSFS_SB(sb);
+	__u32 g;
+	int err;
+
+	for (g = 0;g < psbi->nr_groups;g++) {
+		err = psfs_build_group_index(sb,&psbi->groups[g]);
+		if (err) {
+			psfs_destroy_free_index(psbi);
+			return err;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Free the index nodes. The groups' free_blocks are left as they are,
+ * psfs_put_groups still has to write them out.
+ */
+void psfs_destroy_free_index(struct psfs_sb_info *psbi)
+{
+	struct rb_node *n;
+	__u32 g;
+
+	if (!psbi->groups)
+		return;
+	for (g = 0;g < psbi->nr_groups;g++) {
+		struct psfs_group_info *grp = &psbi->groups[g];
+		while ((n = rb_first(&grp->free_by_start))) {
+			struct psfs_free_extent *fe;
+			fe = rb_entry(n,struct psfs_free_extent,by_start);
+			rb_erase(&fe->by_start,&grp->free_by_start);
+			rb_erase(&fe->by_len,&grp->free_by_len);
+			kfree(fe);
+		}
+	}
+}
+
+/*
+ * Pick an extent of nr_blocks from the group's index, best fit. If there's
+ * no run that long the longest run is handed out instead.
+ *
+ * Returns 0 on success, 1 for a partial extent (check extent->length) and
+ * -ENOSPC if there are no free blocks. Same contract as alloc_psfs_extent.
+ */
+int psfs_index_alloc(struct psfs_group_info *grp,__u64 nr_blocks,
+			struct psfs_extent *extent)
+{
+	struct psfs_free_extent *fe;
+	struct rb_node *n;
+	__u64 len;
+
+	if (!nr_blocks)
+		return -EINVAL;
+	spin_lock(&grp->lock);
+	fe = psfs_free_best_fit(grp,nr_blocks);
+	if (!fe) {
+		n = rb_last(&grp->free_by_len);
+		if (!n) {
+			spin_unlock(&grp->lock);
+			return -ENOSPC;
+		}
+		fe = rb_entry(n,struct psfs_free_extent,by_len);
+	}
+	len = min(fe->len,nr_blocks);
+	extent->block_no = (__u32)fe->start;
+	extent->length = (__u32)len;
+	psfs_free_erase(grp,fe);
+	if (fe->len > len) {
+		/*Start order is unchanged, only re-key the length.*/
+		fe->start += len;
+		fe->len -= len;
+		psfs_free_insert(grp,fe);
+		fe = NULL;
+	}
+	spin_unlock(&grp->lock);
+	kfree(fe);
+	return !(len == nr_blocks);
+}
+
+/*
+ * Return an extent to the index, merging it with the free runs on either
+ * side of it. new_fe is allocated by the caller and used up here.
+ */
+static void __psfs_index_free(struct psfs_group_info *grp,__u64 start,
+				__u64 len,struct psfs_free_extent *new_fe)
+{
+	struct psfs_free_extent *prev = NULL,*next = NULL;
+	struct rb_node *n;
+
+	spin_lock(&grp->lock);
+	/*Find the first free extent starting after us.*/
+	n = grp->free_by_start.rb_node;
+	while (n) {
+		struct psfs_free_extent *cur;
+		cur = rb_entry(n,struct psfs_free_extent,by_start);
+		if (cur->start > start) {
+			next = cur;
+			n = n->rb_left;
+		}
+		else
+			n = n->rb_right;
+	}
+	if (next)
+		n = rb_prev(&next->by_start);
+	else
+		n = rb_last(&grp->free_by_start);
+	if (n)
+		prev = rb_entry(n,struct psfs_free_extent,by_start);
+
+	if (prev && prev->start + prev->len == start) {
+		psfs_free_erase(grp,prev);
+		start = prev->start;
+		len += prev->len;
+		kfree(new_fe);
+		new_fe = prev;
+	}
+	if (next && start + len == next->start) {
+		psfs_free_erase(grp,next);
+		len += next->len;
+		kfree(next);
+	}
+	new_fe->start = start;
+	new_fe->len = len;
+	psfs_free_insert(grp,new_fe);
+	spin_unlock(&grp->lock);
+}
+
+int psfs_index_free(struct psfs_group_info *grp,__u64 start,__u64 len)
+{
+	struct psfs_free_extent *new_fe;
+
+	if (!len)
+		return 0;
+	new_fe = kmalloc(sizeof(*new_fe),GFP_NOFS);
+	if (!new_fe)
+		return -ENOMEM;
+	__psfs_index_free(grp,start,len,new_fe);
+	return 0;
+}
+
+/*
+ * Set or clear the data bitmap bits of [start,start+len). The range lies
+ * within one group, the caller holds nothing, the group lock is taken per
+ * bitmap block.
+ */
+static int psfs_mark_data_bits(struct super_block *sb,
+				struct psfs_group_info *grp,
+				__u64 start,__u64 len,int set)
+{
+	struct psfs_sb_info *psbi = PSFS_SB(sb);
+	while (len) {
+		struct buffer_head *bh;
+		__u64 bit = start & psbi->bits_per_block_mask;
+		__u64 n = min_t(__u64,len,psbi->bits_per_block_mask + 1 - bit);
+
+		bh = psfs_bmap_bh(sb,PSFS_DATA_BMAP,
+				start >> psbi->bits_per_block_shift);
+		if (!bh)
+			return -EIO;
+		spin_lock(&grp->lock);
+		if (set)
+			psfs_bmap_set_range(bh->b_data,bit,n);
+		else
+			psfs_bmap_clear_range(bh->b_data,bit,n);
+		spin_unlock(&grp->lock);
+		mark_buffer_dirty(bh);
+		start += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Allocate up to nr_blocks contiguous blocks, preferably from @goal, and
+ * mark them in the data bitmap. Other groups are tried when the goal
+ * group is full.
+ *
+ * Returns 0 or 1 (partial, check extent->length) like psfs_index_alloc,
+ * negative on error.
+ */
+int psfs_alloc_blocks(struct super_block *sb,struct psfs_group_info *goal,
+			__u64 nr_blocks,struct psfs_extent *extent)
+{
+	struct psfs_sb_info *psbi = PSFS_SB(sb);
+	__u32 start = goal ? goal->group_no : 0;
+	__u32 i;
+	int ret = -ENOSPC;
+
+	for (i = 0;i < psbi->nr_groups;i++) {
+		struct psfs_group_info *grp;
+		grp = &psbi->groups[(start + i) % psbi->nr_groups];
+		psfs_stat_inc(psbi,PSFS_STAT_ALLOC_GROUPS_SCANNED);
+		ret = psfs_index_alloc(grp,nr_blocks,extent);
+		if (ret == -ENOSPC)
+			continue;
+		if (ret < 0)
+			return ret;
+		if (psfs_mark_data_bits(sb,grp,extent->block_no,
+					extent->length,1)) {
+			psfs_index_free(grp,extent->block_no,extent->length);
+			return -EIO;
+		}
+		percpu_counter_sub(&psbi->s_free_blocks,extent->length);
+		psfs_stat_inc(psbi,PSFS_STAT_EXTENTS_ALLOCED);
+		psfs_stat_add(psbi,PSFS_STAT_BLOCKS_ALLOCED,extent->length);
+		if (ret)
+			psfs_stat_inc(psbi,PSFS_STAT_PARTIAL_ALLOCS);
+		PSFS_DBG(PSFS_DEBUG_ALLOC,"psfs: %llu blocks wanted, %u at %u in group %u\n",
+			nr_blocks,extent->length,extent->block_no,grp->group_no);
+		return ret;
+	}
+	return ret;
+}
+
+/*
+ * Give blocks back to the bitmap and the free extent index. The index
+ * node is allocated first: once the bits are clear nothing may fail, or
+ * the blocks would be free on disk but unknown to the allocator.
+ */
+int psfs_free_blocks(struct super_block *sb,__u64 start,__u64 len)
+{
+	struct psfs_group_info *grp = psfs_group_of_block(PSFS_SB(sb),start);
+	__u64 t0 = psfs_trace_clock(psfs_free_extent);
+	struct psfs_free_extent *fe = NULL;
+	int ret = 0;
+
+	if (!grp)
+		ret = -EINVAL;
+	else if (len && !(fe = kmalloc(sizeof(*fe),GFP_NOFS)))
+		ret = -ENOMEM;
+	else {
+		ret = psfs_mark_data_bits(sb,grp,start,len,0);
+		if (!ret && len)
+			__psfs_index_free(grp,start,len,fe);
+		else
+			kfree(fe);
+	}
+	if (!ret) {
+		percpu_counter_add(&PSFS_SB(sb)->s_free_blocks,len);
+		psfs_stat_inc(PSFS_SB(sb),PSFS_STAT_EXTENTS_FREED);
+		psfs_stat_add(PSFS_SB(sb),PSFS_STAT_BLOCKS_FREED,len);
+	}
+	trace_psfs_free_extent(sb,start,len,ret,psfs_trace_delta(t0));
+	return ret;
+}
+
+__u64 psfs_count_free_blocks(struct psfs_sb_info *psbi)
+{
+	__u64 free = 0;
+	__u32 g;
+	for (g = 0;g < psbi->nr_groups;g++)
+		free += ACCESS_ONCE(psbi->groups[g].free_blocks);
+	return free;
+}
+
+/*
+ * Delayed allocation: a write only promises that nr blocks will be there
+ * at writeback, the blocks are picked by psfs_alloc_blocks when the pages
+ * get flushed. The cheap per-cpu estimates are used unless we're close to
+ * running out, where they may be off by up to a batch per cpu.
+ */
+int psfs_reserve_blocks(struct super_block *sb,__u64 nr)
+{
+	struct psfs_sb_info *psbi = PSFS_SB(sb);
+	s64 slack = (s64)percpu_counter_batch * num_online_cpus();
+	s64 free = percpu_counter_read_positive(&psbi->s_free_blocks);
+	s64 dirty = percpu_counter_read_positive(&psbi->s_dirty_blocks);
+
+	if (dirty + nr + 2 * slack > free) {
+		free = percpu_counter_sum_positive(&psbi->s_free_blocks);
+		dirty = percpu_counter_sum_positive(&psbi->s_dirty_blocks);
+		if (dirty + nr > free)
+			return -ENOSPC;
+	}
+	percpu_counter_add(&psbi->s_dirty_blocks,nr);
+	return 0;
+}
+
+/*
+ * Drop a reservation, either because the blocks got allocated or because
+ * the dirty data went away before writeback.
+ */
+void psfs_release_blocks(struct super_block *sb,__u64 nr)
+{
+	percpu_counter_sub(&PSFS_SB(sb)->s_dirty_blocks,nr);
+}
+
+/*
+ * Free blocks nobody has a reservation on, what preallocation may take
+ * without failing someone else's writeback.
+ */
+__u64 psfs_spare_blocks(struct super_block *sb)
+{
+	struct psfs_sb_info *psbi = PSFS_SB(sb);
+	s64 free = percpu_counter_sum_positive(&psbi->s_free_blocks);
+	s64 dirty = percpu_counter_sum_positive(&psbi->s_dirty_blocks);
+
+	return free > dirty ? free - dirty : 0;
+}
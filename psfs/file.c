@@ -1,27 +1,25 @@
 #define MODULE_OWNERSHIP
 #include "psfs.h"
 #include<linux/buffer_head.h>
+#include<linux/mpage.h>
+#include<linux/writeback.h>
+#include<linux/math64.h>
+#include<linux/blkdev.h>
+#include<trace/events/psfs.h>
 
 int psfs_readdir(struct file * file, void * dirent, filldir_t filldir);
+int psfs_get_block(struct inode *inode,sector_t iblock,
+			struct buffer_head *bh_result,int create);
+static int psfs_da_get_block(struct inode *inode,sector_t iblock,
+			struct buffer_head *bh_result,int create);
+static int psfs_extend_file(struct inode *inode,sector_t iblock);
 
-struct buffer_head * psfs_get_direct_extent(struct psfs_inode_info * psi,__u8 extent_no,__u32 block_no);
-
-static struct psfs_dir_entry * psfs_read_dirent(void * buff,struct psfs_dir_entry * dirent);
 
 static int psfs_open(struct inode *inode, struct file *file) 
 {
-	if(file->f_dentry->d_inode == inode)
-		printk("INODE AND FILE pointer refer to same file\n");
-	if(file && file->f_dentry) {
-		printk (KERN_INFO "pappu paas ho gaya\n");
-		printk (KERN_INFO "Opening file %s and inode is %p ",file->f_dentry->d_name.name,inode);
-	}
-	else if (file)
-		printk (KERN_INFO "Opening file pointer %p and inode is %p ",file,inode);
-	else
-		printk(KERN_INFO "FAT GYA SAB");
-	PSFS_DBG_NONE();
-return 0;
+	PSFS_DBG(PSFS_DEBUG_OPEN,"psfs: open %s ino %lu\n",
+		file->f_dentry->d_name.name,inode->i_ino);
+	return 0;
 }
 
 const struct file_operations psfs_fops = {
@@ -31,107 +29,581 @@ const struct file_operations psfs_fops = {
          .llseek = generic_file_llseek,
 };
 
-int psfs_readdir(struct file * file, void * dirent, filldir_t filldir)
-{  
-	
-	struct dentry *de = file->f_dentry;
-	__u8 direct_extent_no = 0;
-	__u32 block_no = 0;
-	long  bytes_read = PAGE_SIZE;
-	struct psfs_inode_info *psi = PSFS_I(de->d_inode);
+/*
+ * Regular files go through the page cache, see psfs_aops.
+ */
+const struct file_operations psfs_file_fops = {
+	.open = psfs_open,
+	.llseek = generic_file_llseek,
+	.read = do_sync_read,
+	.aio_read = generic_file_aio_read,
+	.write = do_sync_write,
+	.aio_write = generic_file_aio_write,
+	.mmap = generic_file_mmap,
+	.fsync = generic_file_fsync,
+	.splice_read = generic_file_splice_read,
+	.splice_write = generic_file_splice_write,
+};
+
+static int psfs_readpage(struct file *file,struct page *page)
+{
+	return mpage_readpage(page,psfs_get_block);
+}
+
+/*
+ * mpage asks psfs_get_block for as many blocks as it has pages and we
+ * map up to the end of the extent, so a whole extent ends up in one bio.
+ */
+static int psfs_readpages(struct file *file,struct address_space *mapping,
+				struct list_head *pages,unsigned nr_pages)
+{
+	return mpage_readpages(mapping,pages,nr_pages,psfs_get_block);
+}
+
+static int psfs_writepage(struct page *page,struct writeback_control *wbc)
+{
+	return block_write_full_page(page,psfs_get_block,wbc);
+}
+
+/*
+ * This is where delayed blocks get allocated. Everything up to the last
+ * reserved block that has no blocks yet was written since the last
+ * flush, so it's allocated in one go before the pages are written. The
+ * delayed buffers are then mapped by psfs_get_block from
+ * block_write_full_page.
+ */
+static int psfs_writepages(struct address_space *mapping,
+				struct writeback_control *wbc)
+{
+	struct inode *inode = mapping->host;
+	sector_t da_end = ACCESS_ONCE(PSFS_I(inode)->da_end);
+	int ret;
+
+	if (da_end) {
+		ret = psfs_extend_file(inode,da_end - 1);
+		if (ret)
+			return ret;
+	}
+	return mpage_writepages(mapping,wbc,psfs_get_block);
+}
+
+static int psfs_write_begin(struct file *file,struct address_space *mapping,
+			loff_t pos,unsigned len,unsigned flags,
+			struct page **pagep,void **fsdata)
+{
+	return block_write_begin(mapping,pos,len,flags,pagep,psfs_da_get_block);
+}
+
+/*
+ * Give back the reservations of delayed buffers being thrown away.
+ */
+static void psfs_invalidatepage(struct page *page,unsigned long offset)
+{
+	if (page_has_buffers(page)) {
+		struct buffer_head *head = page_buffers(page),*bh = head;
+		unsigned long curr_off = 0;
+		do {
+			if (curr_off >= offset && buffer_delay(bh)) {
+				clear_buffer_delay(bh);
+				psfs_release_blocks(page->mapping->host->i_sb,1);
+			}
+			curr_off += bh->b_size;
+		} while ((bh = bh->b_this_page) != head);
+	}
+	block_invalidatepage(page,offset);
+}
+
+/*
+ * Pages with delayed buffers keep their buffers, the delay flag is all
+ * there is to tell the reservation is still held.
+ */
+static int psfs_releasepage(struct page *page,gfp_t gfp)
+{
+	struct buffer_head *head = page_buffers(page),*bh = head;
+	do {
+		if (buffer_delay(bh))
+			return 0;
+	} while ((bh = bh->b_this_page) != head);
+	return try_to_free_buffers(page);
+}
+
+static sector_t psfs_bmap(struct address_space *mapping,sector_t block)
+{
+	return generic_block_bmap(mapping,block,psfs_get_block);
+}
+
+const struct address_space_operations psfs_aops = {
+	.readpage = psfs_readpage,
+	.readpages = psfs_readpages,
+	.writepage = psfs_writepage,
+	.writepages = psfs_writepages,
+	.write_begin = psfs_write_begin,
+	.write_end = generic_write_end,
+	.invalidatepage = psfs_invalidatepage,
+	.releasepage = psfs_releasepage,
+	.bmap = psfs_bmap,
+};
+
+/*
+ * Extent map cache.
+ *
+ * The first lookup on an inode flattens its direct, indirect, double and
+ * triple indirect extents into one array carrying the logical block each
+ * extent starts at. Lookups after that are a binary search, no extent
+ * blocks are read and no lengths are summed.
+ */
+
+static int psfs_emap_add(struct psfs_extent_map **map,__u32 *nr,
+				__u32 *alloced,__u32 pblk,__u32 len)
+{
+	struct psfs_extent_map *m = *map;
+	if (*nr == *alloced) {
+		__u32 new_alloc = *alloced ? *alloced * 2 : PSFS_NR_DIRECT_EXTENTS;
+		m = krealloc(*map,new_alloc * sizeof(*m),GFP_NOFS);
+		if (!m)
+			return -ENOMEM;
+		*map = m;
+		*alloced = new_alloc;
+	}
+	m[*nr].lblk = *nr ? m[*nr - 1].lblk + m[*nr - 1].len : 0;
+	m[*nr].pblk = pblk;
+	m[*nr].len = len;
+	(*nr)++;
+	return 0;
+}
+
+/*
+ * Add the extents of an indirect extent tree to the map.
+ * @level: 0 for a block of psfs_extents, 1 for a block of block numbers of
+ * such blocks (double indirect), 2 for triple indirect.
+ *
+ * Returns 1 when an unused slot was reached (nothing is mapped after it),
+ * 0 to carry on with the next tree, negative on error.
+ */
+static int psfs_emap_add_indirect(struct super_block *sb,__u32 block,int level,
+				struct psfs_extent_map **map,__u32 *nr,
+				__u32 *alloced)
+{
 	struct buffer_head *bh;
-	char *buff;
-	struct psfs_dir_entry *dentry=NULL;
-	struct psfs_dir_entry dent;
+	int i,ret = 0;
 
-	printk(KERN_INFO PSFS_DBG_VAR(" = %llu\n",file->f_pos));  
-	if(file->f_pos >= psi->psfs_inode.size)
-		return 0;
-	if(psi->vfs_inode.i_sb->s_blocksize - file->f_pos < PSFS_MIN_DIRENT_SIZE)
-		file->f_pos +=psi->vfs_inode.i_sb->s_blocksize - file->f_pos; /*MOVE TO NEXT BLOCK*/
-	printk(KERN_INFO PSFS_DBG_VAR(" = %llx\n",psi->psfs_inode.size));
-	PSFS_DBG_NONE();
-	if (S_ISDIR(psi->psfs_inode.type))
-	{
-		PSFS_DBG_MSG("its a directory \n");
-	}
-	block_no = file->f_pos/de->d_inode->i_sb->s_blocksize;
-	printk(KERN_INFO PSFS_DBG_VAR(" = %u\n",block_no));
-	for(direct_extent_no = 0;direct_extent_no < PSFS_NR_DIRECT_EXTENTS;direct_extent_no++) {
-
-		if((PSFS_INFO_PSFS_INODE(psi,psfs_extent)[direct_extent_no].length)<block_no)
-			block_no = block_no - (PSFS_INFO_PSFS_INODE(psi,psfs_extent)[direct_extent_no].length);
+	bh = psfs_meta_bread(sb,block);
+	if (!bh)
+		return -EIO;
+	if (!level) {
+		struct psfs_extent *extent = (struct psfs_extent *)bh->b_data;
+		int n = sb->s_blocksize/sizeof(struct psfs_extent);
+		for (i = 0;i < n && !ret;i++) {
+			__u32 len = be32_to_cpu(extent[i].length);
+			if (!len)
+				ret = 1;
+			else
+				ret = psfs_emap_add(map,nr,alloced,
+					be32_to_cpu(extent[i].block_no),len);
+		}
+	}
+	else {
+		__be32 *addr = (__be32 *)bh->b_data;
+		int n = sb->s_blocksize/sizeof(__be32);
+		for (i = 0;i < n && !ret;i++) {
+			if (!addr[i])
+				ret = 1;
+			else
+				ret = psfs_emap_add_indirect(sb,be32_to_cpu(addr[i]),
+						level - 1,map,nr,alloced);
+		}
+	}
+	brelse(bh);
+	return ret;
+}
+
+static int psfs_build_extent_map(struct psfs_inode_info *psi)
+{
+	struct psfs_inode *pi = &psi->psfs_inode;
+	__u32 roots[3] = {pi->indirect_extent,pi->double_indirect_extent,
+				pi->triple_indirect_extent};
+	struct psfs_extent_map *map = NULL;
+	__u32 nr = 0,alloced = 0;
+	int i,ret = 0;
+
+	for (i = 0;i < PSFS_NR_DIRECT_EXTENTS && !ret;i++) {
+		if (!pi->psfs_extent[i].length)
+			ret = 1;
 		else
-			break; 
-	}	
-	bh = psfs_get_direct_extent(psi,direct_extent_no,block_no );
-	if(!bh)
-	{
-		PSFS_DBG_MSG("BH IS NULL!!! WT");
-		return -ENOMEM;
-	}
-	buff = bh->b_data;
-	printk(KERN_INFO PSFS_DBG_VAR("=%lx\n",bh->b_size));
-	while( (bytes_read - PSFS_MIN_DIRENT_SIZE) >=0 && file->f_pos < psi->psfs_inode.size) {
-		dentry = psfs_read_dirent(buff,&dent);
-		printk(KERN_INFO PSFS_DBG_VAR("=%d\n",dentry->rec_len));
-                printk(KERN_INFO PSFS_DBG_VAR("=%d\n",dentry->name_len));
-		printk(KERN_INFO PSFS_DBG_VAR("=%llu\n",file->f_pos));
-		if(dentry->name_len) {
-			if(filldir(dirent,dentry->name,dentry->name_len,file->f_pos,de->d_inode->i_ino,psi->psfs_inode.flags&PSFS_DIR?DT_DIR:DT_REG))
-				return 0;
+			ret = psfs_emap_add(&map,&nr,&alloced,
+				pi->psfs_extent[i].block_no,
+				pi->psfs_extent[i].length);
+	}
+	for (i = 0;i < 3 && !ret;i++) {
+		if (!roots[i])
+			break;
+		ret = psfs_emap_add_indirect(psi->vfs_inode.i_sb,roots[i],i,
+						&map,&nr,&alloced);
+	}
+	if (ret < 0) {
+		kfree(map);
+		return ret;
+	}
+	/*
+	 * A file without extents gets ZERO_SIZE_PTR, so the map counts as
+	 * built and the next lookup doesn't come back here. krealloc and
+	 * kfree take it like any other pointer.
+	 */
+	psi->emap = map ? map : ZERO_SIZE_PTR;
+	psi->emap_nr = nr;
+	return 0;
+}
+
+/*
+ * Caller holds emap_sem for write, or is tearing the inode down.
+ */
+void psfs_drop_extent_map(struct psfs_inode_info *psi)
+{
+	kfree(psi->emap);
+	psi->emap = NULL;
+	psi->emap_nr = 0;
+}
+
+/*
+ * Map a logical block of an inode to a disk block.
+ * @max_blocks: set to the number of blocks contiguous on disk from there
+ * on, i.e. what's left of the extent.
+ *
+ * Returns 1 if mapped, 0 for a hole, negative on error.
+ */
+int psfs_map_block(struct inode *inode,sector_t iblock,sector_t *phys,
+			unsigned long *max_blocks)
+{
+	struct psfs_inode_info *psi = PSFS_I(inode);
+	struct psfs_extent_map *m;
+	__u64 start = psfs_trace_clock(psfs_map_block_exit);
+	__u32 lo,hi;
+	int ret = 0;
+
+	trace_psfs_map_block_enter(inode,iblock);
+	down_read(&psi->emap_sem);
+	if (!psi->emap) {
+		up_read(&psi->emap_sem);
+		down_write(&psi->emap_sem);
+		if (!psi->emap)
+			ret = psfs_build_extent_map(psi);
+		downgrade_write(&psi->emap_sem);
+		if (ret < 0)
+			goto out;
+	}
+	lo = 0;
+	hi = psi->emap_nr;
+	while (lo < hi) {
+		__u32 mid = lo + (hi - lo)/2;
+		m = &psi->emap[mid];
+		if (iblock < m->lblk)
+			hi = mid;
+		else if (iblock >= m->lblk + m->len)
+			lo = mid + 1;
+		else {
+			*phys = m->pblk + (iblock - m->lblk);
+			*max_blocks = m->len - (iblock - m->lblk);
+			ret = 1;
+			goto out;
+		}
+	}
+	ret = 0;
+out:
+	up_read(&psi->emap_sem);
+	trace_psfs_map_block_exit(inode,iblock,ret > 0 ? *phys : 0,
+			ret > 0 ? *max_blocks : 0,ret,psfs_trace_delta(start));
+	return ret;
+}
+
+/*
+ * Get a zeroed block for the indirect extent trees of an inode.
+ * Returns the block number, 0 on failure (block 0 is the boot block and
+ * never handed out).
+ */
+static __u32 psfs_new_meta_block(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct psfs_extent extent;
+	struct buffer_head *bh;
+
+	if (psfs_alloc_blocks(sb,psfs_group_of_ino(PSFS_SB(sb),inode->i_ino),
+				1,&extent) < 0)
+		return 0;
+	bh = sb_getblk(sb,extent.block_no);
+	if (!bh) {
+		psfs_free_blocks(sb,extent.block_no,1);
+		return 0;
+	}
+	lock_buffer(bh);
+	memset(bh->b_data,0,sb->s_blocksize);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	mark_buffer_dirty_inode(bh,inode);
+	brelse(bh);
+	return extent.block_no;
+}
+
+/*
+ * Store extent number @idx of an inode where it belongs: the direct
+ * extents, then the indirect, double and triple indirect trees. Missing
+ * tree blocks are allocated on the way down.
+ */
+static int psfs_set_extent(struct inode *inode,__u64 idx,
+				struct psfs_extent *extent)
+{
+	struct super_block *sb = inode->i_sb;
+	struct psfs_inode *pi = &PSFS_I(inode)->psfs_inode;
+	__u64 per_block = sb->s_blocksize/sizeof(struct psfs_extent);
+	__u64 per_addr = sb->s_blocksize/sizeof(__be32);
+	__u64 span = per_block,slot_no;
+	struct buffer_head *bh;
+	struct psfs_extent *slot;
+	__u32 *root,block;
+	int level;
+
+	if (idx < PSFS_NR_DIRECT_EXTENTS) {
+		pi->psfs_extent[idx] = *extent;
+		return 0;
+	}
+	idx -= PSFS_NR_DIRECT_EXTENTS;
+	for (level = 0,root = &pi->indirect_extent;;level++,span *= per_addr) {
+		if (idx < span)
+			break;
+		idx -= span;
+		if (level == 2)
+			return -EFBIG;
+		root = level ? &pi->triple_indirect_extent :
+				&pi->double_indirect_extent;
+	}
+	if (!*root && !(*root = psfs_new_meta_block(inode)))
+		return -ENOSPC;
+	block = *root;
+	while (level--) {
+		__be32 *addr;
+		span /= per_addr;
+		bh = sb_bread(sb,block);
+		if (!bh)
+			return -EIO;
+		slot_no = div64_u64(idx,span);
+		addr = (__be32 *)bh->b_data + slot_no;
+		if (!*addr) {
+			__u32 new_block = psfs_new_meta_block(inode);
+			if (!new_block) {
+				brelse(bh);
+				return -ENOSPC;
+			}
+			*addr = cpu_to_be32(new_block);
+			mark_buffer_dirty_inode(bh,inode);
 		}
-		file->f_pos += dentry->rec_len;
-		printk(KERN_INFO PSFS_DBG_VAR("=%d\n",dentry->rec_len));
-		printk(KERN_INFO PSFS_DBG_VAR("=%d\n",dentry->name_len));
-		buff += dentry->rec_len;
-		bytes_read -= dentry->rec_len;
-		printk(KERN_INFO PSFS_DBG_VAR("=%ld\n",bytes_read));
-	}
-return 1;
-}
-
-/*	
-	
-#if 0
-        struct dentry *de = file->f_dentry;
-	printk("de->d_inode->i_ino = %lu\n",de->d_inode->i_ino);
-        if(file->f_pos > 1)
-                return 1;
-        if(filldir(dirent, ".", 1, file->f_pos++, de->d_inode->i_ino, DT_DIR)) {
-                return 0;
-	}
-         if(filldir(dirent, "..", 2, file->f_pos++, de->d_parent->d_inode->i_ino, DT_DIR))
-                return 0;
-        return 1;
-#endif
-}*/
+		block = be32_to_cpu(*addr);
+		brelse(bh);
+		idx -= slot_no * span;
+	}
+	bh = sb_bread(sb,block);
+	if (!bh)
+		return -EIO;
+	slot = (struct psfs_extent *)bh->b_data + idx;
+	slot->block_no = cpu_to_be32(extent->block_no);
+	slot->length = cpu_to_be32(extent->length);
+	mark_buffer_dirty_inode(bh,inode);
+	brelse(bh);
+	return 0;
+}
+
 /*
- * Read block within the given direct extent.
- * @block_no: Must be between 0(inclusive) and extent length(exclusive).
- * @extent_no: index of the direct extent_no.
- * */
-struct buffer_head *psfs_get_direct_extent(struct psfs_inode_info * psi,__u8 extent_no,__u32 block_no)
+ * Zero a new extent starting at logical block @lblk, except for @iblock
+ * which the caller is about to write. Nothing else in there has been
+ * written by the file yet and it must not read back whatever the disk
+ * held before.
+ */
+static int psfs_zero_new_blocks(struct super_block *sb,
+				struct psfs_extent *new,__u64 lblk,sector_t iblock)
 {
-	struct buffer_head *bh=NULL;
-	__u32 disk_block_no = psi->psfs_inode.psfs_extent[extent_no].block_no+block_no;
+	__u64 skip = iblock - lblk;
+	int err = 0;
 
+	if (skip >= new->length)
+		return sb_issue_zeroout(sb,new->block_no,new->length,GFP_NOFS);
+	if (skip)
+		err = sb_issue_zeroout(sb,new->block_no,skip,GFP_NOFS);
+	if (!err && skip + 1 < new->length)
+		err = sb_issue_zeroout(sb,new->block_no + skip + 1,
+				new->length - skip - 1,GFP_NOFS);
+	return err;
+}
+
+/*
+ * Allocate extents until logical block @iblock is mapped.
+ *
+ * Every new extent asks for twice the length of the last one (at least
+ * the volume's minimum extent length), or for all of the missing blocks
+ * if that's more, so a file written sequentially needs O(log n) extents
+ * and allocator calls and a writeback of delayed blocks gets a single
+ * extent. A run the allocator hands back right behind the last extent is
+ * merged into it. The file has no holes, so everything up to iblock gets
+ * allocated. What is asked for past iblock is only a guess and is kept
+ * to the blocks nobody has reserved, see psfs_spare_blocks. New blocks
+ * are zeroed before they show up in the map, see psfs_zero_new_blocks.
+ */
+static int psfs_extend_file(struct inode *inode,sector_t iblock)
+{
+	struct psfs_inode_info *psi = PSFS_I(inode);
+	struct super_block *sb = inode->i_sb;
+	struct psfs_group_info *goal;
+	__u32 alloced = 0;
+	__u64 end_before;
+	int ret = 0;
 
-	if(extent_no >=PSFS_NR_DIRECT_EXTENTS)
-		return bh;
-	if(block_no < psi->psfs_inode.psfs_extent[extent_no].length) {
-		bh = sb_bread(psi->vfs_inode.i_sb,psi->psfs_inode.psfs_extent[extent_no].block_no+block_no);
+	goal = psfs_group_of_ino(PSFS_SB(sb),inode->i_ino);
+	down_write(&psi->emap_sem);
+	if (!psi->emap)
+		ret = psfs_build_extent_map(psi);
+	/*
+	 * The array's capacity isn't kept. Claiming it's full just costs a
+	 * krealloc on the first append.
+	 */
+	alloced = psi->emap_nr;
+	end_before = psi->emap_nr ? psi->emap[psi->emap_nr - 1].lblk +
+			psi->emap[psi->emap_nr - 1].len : 0;
+	while (ret >= 0) {
+		struct psfs_extent_map *last = NULL;
+		struct psfs_extent extent,new;
+		__u64 want,need,end = 0,start;
+		int merged;
+
+		if (psi->emap_nr) {
+			last = &psi->emap[psi->emap_nr - 1];
+			end = last->lblk + last->len;
+			if (iblock < end)
+				break;
+		}
+		want = max_t(__u64,last ? (__u64)last->len * 2 : 1,
+				PSFS_SB(sb)->s_ps->psfs_min_extent_length);
+		need = iblock + 1 - end;
+		if (want > need)
+			want = max_t(__u64,need,
+				min_t(__u64,want,psfs_spare_blocks(sb)));
+		want = max_t(__u64,want,need);
+		want = min_t(__u64,want,(__u32)~0U);
+		start = psfs_trace_clock(psfs_alloc_extent);
+		ret = psfs_alloc_blocks(sb,goal,want,&extent);
+		trace_psfs_alloc_extent(inode,end,want,ret < 0 ? 0 : extent.block_no,
+				ret < 0 ? 0 : extent.length,ret,
+				psfs_trace_delta(start));
+		if (ret < 0)
+			break;
+		new = extent;
+		ret = psfs_zero_new_blocks(sb,&new,end,iblock);
+		if (ret < 0) {
+			psfs_free_blocks(sb,new.block_no,new.length);
+			break;
+		}
+		merged = last && last->pblk + last->len == extent.block_no &&
+			(__u64)last->len + extent.length <= (__u32)~0U;
+		if (merged) {
+			extent.block_no = last->pblk;
+			extent.length += last->len;
+			ret = psfs_set_extent(inode,psi->emap_nr - 1,&extent);
+			if (!ret)
+				last->len = extent.length;
+		}
+		else
+			ret = psfs_set_extent(inode,psi->emap_nr,&extent);
+		if (ret < 0) {
+			psfs_free_blocks(sb,new.block_no,new.length);
+			break;
+		}
+		if (!merged && psfs_emap_add(&psi->emap,&psi->emap_nr,&alloced,
+					extent.block_no,extent.length)) {
+			/*It's on disk already, the next lookup rebuilds the map.*/
+			psfs_drop_extent_map(psi);
+			ret = -ENOMEM;
+		}
 	}
+	if (psi->emap_nr && psi->emap[psi->emap_nr - 1].lblk +
+			psi->emap[psi->emap_nr - 1].len != end_before)
+		mark_inode_dirty(inode);
+	up_write(&psi->emap_sem);
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * get_block for the page cache. Maps as much of the request (b_size) as
+ * the extent holding iblock covers. With create set, blocks past the
+ * last extent are allocated, see psfs_extend_file. A delayed buffer's
+ * reservation is used up once it's mapped.
+ */
+int psfs_get_block(struct inode *inode,sector_t iblock,
+			struct buffer_head *bh_result,int create)
+{
+	unsigned long max_blocks = bh_result->b_size >> inode->i_blkbits;
+	unsigned long mapped = 0;
+	sector_t phys = 0;
+	int ret;
+
+	ret = psfs_map_block(inode,iblock,&phys,&mapped);
+	if (ret < 0)
+		return ret;
+	if (!ret) {
+		if (!create)
+			return 0;
+		ret = psfs_extend_file(inode,iblock);
+		if (ret)
+			return ret;
+		ret = psfs_map_block(inode,iblock,&phys,&mapped);
+		if (ret <= 0)
+			return ret ? ret : -EIO;
+		set_buffer_new(bh_result);
+	}
+	if (mapped < max_blocks)
+		max_blocks = mapped;
+	if (create && buffer_delay(bh_result)) {
+		clear_buffer_delay(bh_result);
+		psfs_release_blocks(inode->i_sb,1);
+	}
+	map_bh(bh_result,inode->i_sb,phys);
+	bh_result->b_size = max_blocks << inode->i_blkbits;
+	return 0;
+}
 
-	printk("disk_block_no= %x\n",disk_block_no);
-return bh;
-}	
-static struct psfs_dir_entry * psfs_read_dirent(void * buff,struct psfs_dir_entry * dirent)
+/*
+ * get_block for write_begin. Blocks that aren't there yet are only
+ * reserved, the buffer is left unmapped with the delay flag set and
+ * writeback allocates it, see psfs_writepages.
+ */
+static int psfs_da_get_block(struct inode *inode,sector_t iblock,
+			struct buffer_head *bh_result,int create)
 {
-	memcpy(dirent,buff,PSFS_MIN_DIRENT_SIZE);
-	dirent->inode_nr = be32_to_cpu(dirent->inode_nr);
-	dirent->flags = be16_to_cpu(dirent->flags);
-	dirent->rec_len = be16_to_cpu(dirent->rec_len);
-	memcpy(dirent->name,(char*)buff+PSFS_MIN_DIRENT_SIZE,dirent->name_len);
-	return dirent;
+	unsigned long mapped = 0;
+	sector_t phys = 0;
+	int ret;
+
+	ret = psfs_map_block(inode,iblock,&phys,&mapped);
+	if (ret < 0)
+		return ret;
+	if (ret) {
+		/*
+		 * psfs_writepages allocated it since the reservation was
+		 * taken, the page just hasn't been written yet.
+		 */
+		if (buffer_delay(bh_result)) {
+			clear_buffer_delay(bh_result);
+			psfs_release_blocks(inode->i_sb,1);
+		}
+		map_bh(bh_result,inode->i_sb,phys);
+		return 0;
+	}
+	/*Already reserved by an earlier write to this page.*/
+	if (buffer_delay(bh_result))
+		return 0;
+	ret = psfs_reserve_blocks(inode->i_sb,1);
+	if (ret)
+		return ret;
+	if (iblock >= PSFS_I(inode)->da_end)
+		PSFS_I(inode)->da_end = iblock + 1;
+	bh_result->b_bdev = inode->i_sb->s_bdev;
+	bh_result->b_blocknr = ~(sector_t)0;
+	set_buffer_new(bh_result);
+	set_buffer_delay(bh_result);
+	return 0;
 }
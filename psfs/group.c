@@ -0,0 +1,314 @@
+#define MODULE_OWNERSHIP
+#include "psfs.h"
+#include<linux/buffer_head.h>
+#include<linux/math64.h>
+
+/*
+ * Allocation groups.
+ *
+ * Each group carries its own lock, free counters and free extent index so
+ * that creates and appends in different groups never contend. Volumes
+ * formatted without PSFS_SUPER_AG are treated as one big group.
+ */
+
+static void psfs_group_desc_to_cpu(struct psfs_group_desc *gd)
+{
+	gd->gd_block_bitmap = be64_to_cpu(gd->gd_block_bitmap);
+	gd->gd_inode_bitmap = be64_to_cpu(gd->gd_inode_bitmap);
+	gd->gd_inode_bitmap_off = be32_to_cpu(gd->gd_inode_bitmap_off);
+	gd->gd_free_blocks = be32_to_cpu(gd->gd_free_blocks);
+	gd->gd_free_inodes = be32_to_cpu(gd->gd_free_inodes);
+	gd->gd_flags = be32_to_cpu(gd->gd_flags);
+}
+
+static void psfs_group_desc_to_be(struct psfs_group_desc *gd)
+{
+	gd->gd_block_bitmap = cpu_to_be64(gd->gd_block_bitmap);
+	gd->gd_inode_bitmap = cpu_to_be64(gd->gd_inode_bitmap);
+	gd->gd_inode_bitmap_off = cpu_to_be32(gd->gd_inode_bitmap_off);
+	gd->gd_free_blocks = cpu_to_be32(gd->gd_free_blocks);
+	gd->gd_free_inodes = cpu_to_be32(gd->gd_free_inodes);
+	gd->gd_flags = cpu_to_be32(gd->gd_flags);
+}
+
+static void psfs_init_group(struct psfs_sb_info *psbi,__u32 g)
+{
+	struct psfs_group_info *grp = &psbi->groups[g];
+	__u64 nr_blocks = psbi->s_ps->psfs_nr_blocks;
+	__u64 nr_inodes = psbi->s_ps->psfs_nr_inodes;
+
+	spin_lock_init(&grp->lock);
+	grp->group_no = g;
+	grp->first_block = g * psbi->blocks_per_group;
+	grp->nr_blocks = min_t(__u64,psbi->blocks_per_group,
+				nr_blocks - grp->first_block);
+	grp->first_ino = g * psbi->inodes_per_group;
+	grp->nr_inodes = min_t(__u64,psbi->inodes_per_group,
+				nr_inodes - grp->first_ino);
+	grp->free_by_start = RB_ROOT;
+	grp->free_by_len = RB_ROOT;
+}
+
+/*
+ * Read the group descriptors, or make up the single group of a volume
+ * formatted without them.
+ */
+int psfs_load_groups(struct super_block *sb)
+{
+	struct psfs_sb_info *psbi = PSFS_SB(sb);
+	struct psfs_super_block *ps = psbi->s_ps;
+	__u32 descs_per_block = sb->s_blocksize/sizeof(struct psfs_group_desc);
+	struct buffer_head *bh = NULL;
+	__u32 g;
+
+	if (!(ps->psfs_super_flags & PSFS_SUPER_AG)) {
+		psbi->nr_groups = 1;
+		psbi->blocks_per_group = ps->psfs_nr_blocks;
+		psbi->inodes_per_group = ps->psfs_nr_inodes;
+	}
+	else {
+		psbi->nr_groups = ps->psfs_nr_groups;
+		psbi->blocks_per_group = ps->psfs_blocks_per_group;
+		psbi->inodes_per_group = ps->psfs_inodes_per_group;
+		if (!ps->psfs_nr_groups || !ps->psfs_blocks_per_group ||
+			(ps->psfs_blocks_per_group & psbi->bits_per_block_mask) ||
+			ps->psfs_inodes_per_group % 8) {
+			printk(KERN_ERR "psfs: bad allocation group geometry\n");
+			return -EINVAL;
+		}
+	}
+	psbi->groups = kcalloc(psbi->nr_groups,sizeof(struct psfs_group_info),
+				GFP_KERNEL);
+	if (!psbi->groups)
+		return -ENOMEM;
+
+	for (g = 0;g < psbi->nr_groups;g++) {
+		struct psfs_group_info *grp = &psbi->groups[g];
+		struct psfs_group_desc gd;
+
+		psfs_init_group(psbi,g);
+		if (!(ps->psfs_super_flags & PSFS_SUPER_AG)) {
+			grp->block_bitmap = psbi->data_bmp_block;
+			grp->inode_bitmap = psbi->inode_bmp_block;
+			grp->inode_bitmap_off = 0;
+			grp->free_inodes = grp->nr_inodes;
+			continue;
+		}
+		if (!(g % descs_per_block)) {
+			brelse(bh);
+			bh = sb_bread(sb,ps->psfs_group_desc_block + g/descs_per_block);
+			if (!bh) {
+				psfs_put_groups(sb);
+				return -EIO;
+			}
+		}
+		memcpy(&gd,((struct psfs_group_desc *)bh->b_data) + (g % descs_per_block),
+			sizeof(gd));
+		psfs_group_desc_to_cpu(&gd);
+		grp->block_bitmap = gd.gd_block_bitmap;
+		grp->inode_bitmap = gd.gd_inode_bitmap;
+		grp->inode_bitmap_off = gd.gd_inode_bitmap_off;
+		grp->free_inodes = gd.gd_free_inodes;
+		/*free_blocks is recounted from the bitmap by the free index.*/
+	}
+	brelse(bh);
+	return 0;
+}
+
+/*
+ * Write the free counters back to the descriptors and drop the groups
+ * along with their free extent index.
+ */
+void psfs_put_groups(struct super_block *sb)
+{
+	struct psfs_sb_info *psbi = PSFS_SB(sb);
+	__u32 descs_per_block = sb->s_blocksize/sizeof(struct psfs_group_desc);
+	struct buffer_head *bh = NULL;
+	__u32 g;
+
+	if (!psbi->groups)
+		return;
+	if (!(psbi->s_ps->psfs_super_flags & PSFS_SUPER_AG) ||
+		(sb->s_flags & MS_RDONLY))
+		goto out;
+	for (g = 0;g < psbi->nr_groups;g++) {
+		struct psfs_group_desc *gd;
+		if (!(g % descs_per_block)) {
+			if (bh) {
+				mark_buffer_dirty(bh);
+				brelse(bh);
+			}
+			bh = sb_bread(sb,psbi->s_ps->psfs_group_desc_block +
+					g/descs_per_block);
+			if (!bh)
+				goto out;
+		}
+		gd = ((struct psfs_group_desc *)bh->b_data) + (g % descs_per_block);
+		psfs_group_desc_to_cpu(gd);
+		gd->gd_free_blocks = psbi->groups[g].free_blocks;
+		gd->gd_free_inodes = psbi->groups[g].free_inodes;
+		psfs_group_desc_to_be(gd);
+	}
+	if (bh) {
+		mark_buffer_dirty(bh);
+		brelse(bh);
+	}
+out:
+	psfs_destroy_free_index(psbi);
+	kfree(psbi->groups);
+	psbi->groups = NULL;
+}
+
+struct psfs_group_info *psfs_group_of_block(struct psfs_sb_info *psbi,
+						__u64 block)
+{
+	__u64 g = div64_u64(block,psbi->blocks_per_group);
+	if (g >= psbi->nr_groups)
+		return NULL;
+	return &psbi->groups[g];
+}
+
+struct psfs_group_info *psfs_group_of_ino(struct psfs_sb_info *psbi,__u64 ino)
+{
+	__u64 g = div64_u64(ino,psbi->inodes_per_group);
+	if (g >= psbi->nr_groups)
+		return NULL;
+	return &psbi->groups[g];
+}
+
+/*
+ * Choose the group a new inode goes to. Directories are spread by the CPU
+ * doing the create so parallel mkdirs land in different groups, files
+ * stay next to their parent directory. Full groups are skipped.
+ */
+struct psfs_group_info *psfs_pick_group(struct super_block *sb,
+					struct inode *dir,int mode)
+{
+	struct psfs_sb_info *psbi = PSFS_SB(sb);
+	struct psfs_group_info *grp = NULL;
+	__u32 start,i;
+
+	if (dir && !S_ISDIR(mode))
+		grp = psfs_group_of_ino(psbi,dir->i_ino);
+	start = grp ? grp->group_no : raw_smp_processor_id() % psbi->nr_groups;
+	for (i = 0;i < psbi->nr_groups;i++) {
+		grp = &psbi->groups[(start + i) % psbi->nr_groups];
+		if (ACCESS_ONCE(grp->free_inodes))
+			return grp;
+	}
+	return NULL;
+}
+
+/*
+ * Take the first free bit of the group's inodes [from,to), relative to
+ * first_ino. Returns the inode number, -ENOSPC or -EIO.
+ */
+static int64_t psfs_group_take_ino(struct super_block *sb,
+				struct psfs_group_info *grp,__u32 from,__u32 to)
+{
+	struct psfs_sb_info *psbi = PSFS_SB(sb);
+
+	while (from < to) {
+		__u64 ino = grp->first_ino + from;
+		__u64 bit = ino & psbi->bits_per_block_mask;
+		__u64 n = min_t(__u64,to - from,psbi->bits_per_block_mask + 1 - bit);
+		struct buffer_head *bh;
+		__u64 free;
+
+		bh = psfs_bmap_bh(sb,PSFS_INODE_BMAP,ino >> psbi->bits_per_block_shift);
+		if (!bh)
+			return -EIO;
+		spin_lock(&grp->lock);
+		free = psfs_find_next_zero_bit((unsigned char *)bh->b_data,
+						bit + n,bit);
+		if (free < bit + n) {
+			bh->b_data[free >> 3] |= 1 << (free & 7);
+			grp->inode_bmap_hint = from + (free - bit) + 1;
+			grp->free_inodes--;
+			spin_unlock(&grp->lock);
+			percpu_counter_dec(&psbi->s_free_inodes);
+			/*Written back with the rest of the dirty buffers.*/
+			mark_buffer_dirty(bh);
+			return ino + (free - bit);
+		}
+		spin_unlock(&grp->lock);
+		from += n;
+	}
+	return -ENOSPC;
+}
+
+/*
+ * Allocate an inode number from a group's slice of the inode bitmap.
+ * The search starts at the group's hint, so only the bitmap block it
+ * points into is scanned in the common case, and wraps around to the
+ * start of the group. Only the group's lock is taken.
+ *
+ * Returns the inode number or a negative errno.
+ */
+int64_t psfs_group_alloc_ino(struct super_block *sb,struct psfs_group_info *grp)
+{
+	__u32 hint = ACCESS_ONCE(grp->inode_bmap_hint);
+	int64_t ino;
+
+	if (hint >= grp->nr_inodes)
+		hint = 0;
+	ino = psfs_group_take_ino(sb,grp,hint,grp->nr_inodes);
+	if (ino == -ENOSPC && hint)
+		ino = psfs_group_take_ino(sb,grp,0,hint);
+	if (ino >= 0)
+		PSFS_DBG(PSFS_DEBUG_ALLOC,"psfs: inode %llu from group %u\n",
+			ino,grp->group_no);
+	return ino;
+}
+
+/*
+ * Count the free inodes of every group from the inode bitmap, once at
+ * mount. The descriptor counts aren't trusted, they're only written back
+ * at umount. Returns the total or a negative errno.
+ */
+int64_t psfs_count_free_inodes(struct super_block *sb)
+{
+	struct psfs_sb_info *psbi = PSFS_SB(sb);
+	int64_t total = 0;
+	__u32 g;
+
+	for (g = 0;g < psbi->nr_groups;g++) {
+		struct psfs_group_info *grp = &psbi->groups[g];
+		__u64 block = grp->inode_bitmap;
+		__u32 off = grp->inode_bitmap_off;
+		__u32 bytes_left = grp->nr_inodes/8;
+		__u32 used = 0;
+
+		while (bytes_left) {
+			struct buffer_head *bh;
+			__u32 len = min_t(__u32,bytes_left,sb->s_blocksize - off);
+			__u32 i;
+
+			bh = psfs_bmap_bh(sb,PSFS_INODE_BMAP,
+					block - psbi->inode_bmp_block);
+			if (!bh)
+				return -EIO;
+			for (i = 0;i < len;i++)
+				used += hweight8(((__u8 *)bh->b_data)[off + i]);
+			bytes_left -= len;
+			block++;
+			off = 0;
+		}
+		/*The last few inodes may not fill a byte.*/
+		if (grp->nr_inodes & 7) {
+			__u64 ino = grp->first_ino + (grp->nr_inodes & ~7U);
+			__u64 bit = ino & psbi->bits_per_block_mask;
+			struct buffer_head *bh;
+
+			bh = psfs_bmap_bh(sb,PSFS_INODE_BMAP,
+					ino >> psbi->bits_per_block_shift);
+			if (!bh)
+				return -EIO;
+			used += hweight8(((__u8 *)bh->b_data)[bit >> 3] &
+					((1 << (grp->nr_inodes & 7)) - 1));
+		}
+		grp->free_inodes = grp->nr_inodes - used;
+		total += grp->free_inodes;
+	}
+	return total;
+}
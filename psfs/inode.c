@@ -1,10 +1,15 @@
 #define MODULE_OWNERSHIP
 #include "psfs.h"
 #include<linux/buffer_head.h>
+#include<linux/reciprocal_div.h>
+#include<linux/writeback.h>
+#include<trace/events/psfs.h>
 
 static struct kmem_cache *psfs_inode_cachep;
 extern const struct inode_operations psfs_iops;
 extern const struct file_operations psfs_fops;
+extern const struct file_operations psfs_file_fops;
+extern const struct address_space_operations psfs_aops;
 static struct psfs_inode_info *psfs_alloc_inode(struct super_block *sb);
 static struct dentry *psfs_lookup(struct inode * dir, struct dentry *dentry,
 					struct nameidata *nd);
@@ -35,45 +40,6 @@ psfs_extent->length = cpu_to_be32(psfs_extent->length);\
 
 void psfs_destroy_inode(struct inode *inode);
 
-/*
- * This function attempts to allocate the requested extent.
- * @extent: The extent that needs to be initialized.
- * @nr_blocks: consecutive blocks requested for extent.
- * @bitmap: The block of FS containing bitmap.
- * @bmap_len: The length of the passed in bitmap.
- *
- * Return Value: -1 is an error state, 0 is a success state, 1 is a partial
- * success state returned. You must check the extent->nr_blocks to know
- * how many blocks long is the extent if the return state is 1.
- *
- * The function will not attempt to move over to next bitmap if it can't
- * fulfill the request entirely. So return value must be checked by caller.
- *
- * Larger extents maybe allocated by maintaining 2 extents, one will be
- * modified by this code the other external. However appropriate locking 
- * is the responsibility of the caller.
- * */
-static int alloc_psfs_extent(struct psfs_extent *extent, int64_t nr_blocks,
-                                char *bitmap, int32_t bmap_len)
-{
-        int64_t blocks_alloced = 0;
-        int32_t start_block = -1;
-        while(blocks_alloced<nr_blocks)
-        {
-                if (start_block < 0) {
-                        start_block = alloc_bmap(bitmap,bmap_len);
-                        if (start_block < 0)
-                                return -1;
-                }
-                else if (alloc_bmap(bitmap,bmap_len) < 0)
-                        break;
-                blocks_alloced++;
-        }
-        extent->block_no = start_block;
-        extent->length = blocks_alloced;
-        return !(blocks_alloced==nr_blocks);
-}
-
 /*
  *Given block bitmap allocate an indirect extent.
  *@nr_blocks: number of blocks to allocate.
@@ -110,7 +76,7 @@ static int alloc_psfs_extent_indirect(int64_t nr_blocks, char *bitmap,
 	 */
 	 int64_t blocks_alloced=0;
 	 int8_t found_free = -1;
-	 const int32_t extent_per_block = sizeof(struct psfs_extent)/block_size;
+	 const int32_t extent_per_block = block_size/sizeof(struct psfs_extent);
 	 struct psfs_extent *direct_extent = NULL;
 	 if (block) {
 	 	int32_t i = 0;
@@ -121,8 +87,8 @@ static int alloc_psfs_extent_indirect(int64_t nr_blocks, char *bitmap,
 			if (direct_extent->length == 0) {
 				found_free=1;
 				if (alloc_psfs_extent(direct_extent,
-						nr_blocks, bitmap,
-						bmap_len) < 0 )
+						nr_blocks - blocks_alloced,
+						bitmap, bmap_len, NULL) < 0 )
 					break;
 				blocks_alloced += direct_extent->length;
 				direct_extent->block_no+=block_no_offset;
@@ -151,23 +117,18 @@ return (found_free==1?blocks_alloced:found_free);
 static int32_t free_psfs_extent(char *bitmap,int32_t bmap_len,
 				struct psfs_extent *extent)
 {
-	__u64 which_byte = extent->block_no/8;
-	__u32 start_block = extent->block_no; /*Old value of block_no*/
-	while(which_byte < bmap_len && extent->length > 0) {
-		/*
-		 *First find the bitmap block of this,
-		 *extent's starting block.
-		 */
-		int32_t bit_pos = extent->block_no%8;
-		for( ;bit_pos < 8 && extent->length > 0;bit_pos++)
-		{
-			bitmap[which_byte]|=~(1<<(bit_pos%8));
-			extent->block_no++;
-			extent->length--;
-		}
-		which_byte++;
-	}	
-return (int32_t)(extent->block_no - start_block);
+	__u64 nbits = (__u64)bmap_len * 8;
+	__u32 nr_free;
+
+	if (extent->block_no >= nbits)
+		return 0;
+	nr_free = extent->length;
+	if (extent->block_no + (__u64)nr_free > nbits)
+		nr_free = nbits - extent->block_no;
+	psfs_bmap_clear_range(bitmap,extent->block_no,nr_free);
+	extent->block_no += nr_free;
+	extent->length -= nr_free;
+return (int32_t)nr_free;
 }
 
 /*
@@ -187,7 +148,7 @@ static int32_t free_psfs_extent_indirect_block
 				char *block,
 				char* (*get_bitmap)(int32_t which_block))
 {
-	const int32_t nr_extents_per_block = sizeof(struct psfs_extent)/block_size;
+	const int32_t nr_extents_per_block = block_size/sizeof(struct psfs_extent);
 	char *bmap_to_use;
 	int32_t i=0;
 	for ( i=0;i < nr_extents_per_block; i++) {
@@ -230,7 +191,7 @@ static void psfs_inode_to_be(struct psfs_inode *inode)
 	int nr_direct_extent = PSFS_NR_DIRECT_EXTENTS;
 	while (--nr_direct_extent>=0) {
 		struct psfs_extent *extent = &inode->psfs_extent[nr_direct_extent];
-		PSFS_EXTENT_TO_CPU(extent);
+		PSFS_EXTENT_TO_BE(extent);
 	}
 	inode->size = cpu_to_be64(inode->size);
 	inode->indirect_extent = cpu_to_be32(inode->indirect_extent);
@@ -248,12 +209,34 @@ static void psfs_inode_to_be(struct psfs_inode *inode)
 
 static struct dentry *psfs_lookup(struct inode * dir, struct dentry *dentry, struct nameidata *nd)
 {
-        printk("i am in function %s\n",__FUNCTION__);
-        return NULL;
+	struct inode *inode = NULL;
+	__u64 start = psfs_trace_clock(psfs_lookup_exit);
+	__u32 ino;
+	int ret;
+
+	if (dentry->d_name.len > PSFS_FILENAME_LEN)
+		return ERR_PTR(-ENAMETOOLONG);
+	trace_psfs_lookup_enter(dir,0);
+	ret = psfs_find_entry(dir,&dentry->d_name,&ino);
+	trace_psfs_lookup_exit(dir,dentry->d_name.name,ret > 0 ? ino : 0,ret,
+				psfs_trace_delta(start));
+	PSFS_DBG(PSFS_DEBUG_LOOKUP,"psfs: lookup %s in %lu: %d ino %u\n",
+		dentry->d_name.name,dir->i_ino,ret,ret > 0 ? ino : 0);
+	if (ret < 0)
+		return ERR_PTR(ret);
+	if (ret) {
+		inode = psfs_iget(dir->i_sb,ino);
+		if (IS_ERR(inode))
+			return ERR_CAST(inode);
+	}
+	d_add(dentry,inode);
+	return NULL;
 }
 
 void psfs_destroy_inode(struct inode *inode)
 {
+	psfs_dcache_drop(PSFS_I(inode));
+	psfs_drop_extent_map(PSFS_I(inode));
         kmem_cache_free(psfs_inode_cachep,container_of(inode,struct psfs_inode_info,vfs_inode));
 }
 
@@ -262,17 +245,38 @@ const struct inode_operations psfs_iops = {
 //	.create = psfs_create,
 };
 
+/*
+ * Wire up the operations matching the inode's mode.
+ */
+void psfs_set_inode_ops(struct inode *inode)
+{
+	inode->i_op = &psfs_iops;
+	if (S_ISREG(inode->i_mode)) {
+		inode->i_fop = &psfs_file_fops;
+		inode->i_mapping->a_ops = &psfs_aops;
+	}
+	else
+		inode->i_fop = &psfs_fops;
+}
+
 static inline struct psfs_inode_info *psfs_alloc_inode(struct super_block *sb)
 {      
-        PSFS_DBG_NONE();
-	return((struct  psfs_inode_info*)kmem_cache_alloc(psfs_inode_cachep, GFP_KERNEL));
+	struct psfs_inode_info *psi;
+	psi = kmem_cache_alloc(psfs_inode_cachep, GFP_KERNEL);
+	if (psi) {
+		psi->emap = NULL;
+		psi->emap_nr = 0;
+		psi->da_end = 0;
+		psi->dcache = NULL;
+	}
+	return psi;
 }
 
 static void init_once(void *object)
 {
 	struct psfs_inode_info * psi = (struct psfs_inode_info *)object;
-        PSFS_DBG_NONE();
         inode_init_once(&psi->vfs_inode);
+	init_rwsem(&psi->emap_sem);
         return;
 }
 int init_inodecache(void)
@@ -298,48 +302,140 @@ struct psfs_inode *psfs_read_inode(struct super_block *sb, unsigned int ino,
                                struct psfs_inode_info *psi)
 {    
         struct buffer_head *bh;
-        __u64 block;
-        __u32 inodes_per_block;
-	PSFS_DBG_NONE(); 
-        inodes_per_block = sb->s_blocksize/(sizeof(struct psfs_inode));
-        block = ino/inodes_per_block;
-        bh = sb_bread(sb, block + 1);
+        struct psfs_sb_info *psbi = PSFS_SB(sb);
+        __u32 block,offset;
+	__u64 start = psfs_trace_clock(psfs_read_inode_exit);
+	trace_psfs_read_inode_enter(&psi->vfs_inode,0);
+	if (ino >= psbi->s_ps->psfs_nr_inodes) {
+		trace_psfs_read_inode_exit(&psi->vfs_inode,0,-EINVAL,
+				psfs_trace_delta(start));
+		return NULL;
+	}
+        block = psfs_ino_to_block(psbi,ino,&offset);
+        bh = psfs_meta_bread(sb, psbi->inode_table_block + block);
+	psfs_stat_inc(psbi,PSFS_STAT_INODE_READS);
         if (!bh) {
+		trace_psfs_read_inode_exit(&psi->vfs_inode,
+				psbi->inode_table_block + block,-EIO,
+				psfs_trace_delta(start));
                 return NULL;
         }
-#if 1
-	{
-		int i = 0;
-		for(;i<sizeof(struct psfs_inode);i++)
-		{
-			printk (KERN_INFO "=0x%x  ",bh->b_data[i]);
-			if( (i % 0x10) == 0 )
-				printk(KERN_INFO "\n");
-		}
-		printk("Buffer head is at %p and pointer is at %p\n",bh->b_data,
-			(((struct psfs_inode *)(bh->b_data)) + (ino-(block*inodes_per_block))));
-	}
-#endif
 	/*
 	 *FIXME: 
 	 * Change this when using bio istead of bread. This only works
 	 * when blocksize<=PAGE_SIZE. blocksize must be a multiple of
 	 * KERNEL_SECTOR_SIZE=512.
 	 */
-	memcpy(&psi->psfs_inode,(((struct psfs_inode *)(bh->b_data)) + (ino-(block*inodes_per_block))),sizeof(struct psfs_inode));
+	memcpy(&psi->psfs_inode,(((struct psfs_inode *)(bh->b_data)) + offset),sizeof(struct psfs_inode));
 	psfs_inode_to_cpu(&psi->psfs_inode);
         psi->vfs_inode.i_size = psi->psfs_inode.size;
-        printk(KERN_INFO PSFS_DBG_VAR(" = %x\n",psi->psfs_inode.flags));
-        printk(KERN_INFO PSFS_DBG_VAR("size = %llx\n",psi->psfs_inode.size));
+	if (psi->psfs_inode.type)
+		psi->vfs_inode.i_mode = psi->psfs_inode.type;
+	else if (ino == PSFS_ROOT_INODE)
+		psi->vfs_inode.i_mode = S_IFDIR | 0755;	/*Images from before type*/
+	psi->vfs_inode.i_atime.tv_sec = psi->psfs_inode.a_time;
+	psi->vfs_inode.i_mtime.tv_sec = psi->psfs_inode.m_time;
+	psi->vfs_inode.i_ctime.tv_sec = psi->psfs_inode.c_time;
+	psfs_set_inode_ops(&psi->vfs_inode);
+	PSFS_DBG(PSFS_DEBUG_INODE,"psfs: read inode %u mode %o size %llu flags %x\n",
+		ino,psi->vfs_inode.i_mode,psi->psfs_inode.size,psi->psfs_inode.flags);
 	brelse(bh);
+	trace_psfs_read_inode_exit(&psi->vfs_inode,psbi->inode_table_block + block,
+				0,psfs_trace_delta(start));
 	return (&psi->psfs_inode);
 }
 
+/*
+ * Copy the in core inode back to its slot in the inode table. Extents
+ * are already up to date in psi->psfs_inode, the write path keeps them
+ * there.
+ */
+int psfs_write_inode(struct inode *inode,struct writeback_control *wbc)
+{
+	struct psfs_sb_info *psbi = PSFS_SB(inode->i_sb);
+	struct psfs_inode_info *psi = PSFS_I(inode);
+	struct psfs_inode *raw;
+	struct buffer_head *bh;
+	__u32 block,offset;
+	int lazy,err = 0;
+
+	block = psfs_ino_to_block(psbi,inode->i_ino,&offset);
+	/*
+	 * Not zeroed yet, keep the lazy init thread off this block while our
+	 * slot is written.
+	 */
+	lazy = block >= ACCESS_ONCE(psbi->s_ps->psfs_itable_zeroed);
+	if (lazy)
+		mutex_lock(&psbi->s_itable_lock);
+	bh = sb_bread(inode->i_sb,psbi->inode_table_block + block);
+	/*
+	 * The rest of the block still holds whatever was on the disk, clear
+	 * it before the block goes out with our slot in it.
+	 */
+	if (bh && lazy && block >= psbi->s_ps->psfs_itable_zeroed &&
+		psfs_itable_zero_free(inode->i_sb,block,bh)) {
+		brelse(bh);
+		bh = NULL;
+	}
+	if (!bh) {
+		if (lazy)
+			mutex_unlock(&psbi->s_itable_lock);
+		return -EIO;
+	}
+	raw = ((struct psfs_inode *)bh->b_data) + offset;
+	/*
+	 * psfs_extend_file updates the extents under emap_sem, don't copy
+	 * one it's half way through.
+	 */
+	down_read(&psi->emap_sem);
+	psi->psfs_inode.size = i_size_read(inode);
+	psi->psfs_inode.inode_nr = inode->i_ino;
+	psi->psfs_inode.type = inode->i_mode;
+	psi->psfs_inode.a_time = inode->i_atime.tv_sec;
+	psi->psfs_inode.m_time = inode->i_mtime.tv_sec;
+	psi->psfs_inode.c_time = inode->i_ctime.tv_sec;
+	memcpy(raw,&psi->psfs_inode,sizeof(*raw));
+	up_read(&psi->emap_sem);
+	psfs_inode_to_be(raw);
+	mark_buffer_dirty(bh);
+	if (lazy)
+		mutex_unlock(&psbi->s_itable_lock);
+	if (wbc->sync_mode == WB_SYNC_ALL) {
+		sync_dirty_buffer(bh);
+		if (buffer_req(bh) && !buffer_uptodate(bh))
+			err = -EIO;
+	}
+	brelse(bh);
+	return err;
+}
+
+/*
+ * Get the in core inode for ino, reading it from the inode table only if
+ * it isn't in the inode cache already.
+ */
+struct inode *psfs_iget(struct super_block *sb,unsigned long ino)
+{
+	struct inode *inode;
+
+	inode = iget_locked(sb,ino);
+	if (!inode)
+		return ERR_PTR(-ENOMEM);
+	if (!(inode->i_state & I_NEW)) {
+		psfs_stat_inc(PSFS_SB(sb),PSFS_STAT_ICACHE_HITS);
+		return inode;
+	}
+	if (!psfs_read_inode(sb,ino,PSFS_I(inode))) {
+		iget_failed(inode);
+		return ERR_PTR(-EIO);
+	}
+	unlock_new_inode(inode);
+	return inode;
+}
+
 struct inode *psfs_get_inode(struct super_block *sb)
 {
         struct psfs_inode_info *psi;
 	psi = psfs_alloc_inode(sb);
-	printk(KERN_INFO PSFS_DBG_VAR(" = %p\n",psi));
         if(!psi)
                 return ERR_PTR(-ENOMEM);
 /*      psi->vfs_inode.i_sb = sb;   here is the culprit set the super block in the inode because inode_int_always is not called upto this point
@@ -357,33 +453,38 @@ struct inode *psfs_get_inode(struct super_block *sb)
 	
 static int psfs_create(struct inode *parent_inode ,struct dentry *dentry,int mode,struct nameidata *nadata)
 {
-	struct buffer_head *inode_bmp_bh;
-	struct buffer_head *data_bmp_bh;
+	struct psfs_group_info *grp;
 	struct psfs_inode_info *psi;
-	__u32 ino =0;
+	int64_t ino;
 	struct inode *inode = new_inode(parent_inode->i_sb);
-	insert_inode_hash(inode);
 	if(!inode)
 	{
 		PSFS_DBG_MSG("could not allocate inode from inode cache");
 		return -ENOMEM; 
 	}
 	psi = PSFS_I(inode);
-	inode_bmp_bh = sb_bread(parent_inode->i_sb,psfs_inode_bmp_block);
-	ino = alloc_bmap((char *)inode_bmp_bh,parent_inode->i_sb->s_blocksize);
-	if(!ino)
+	/*
+	 * Only the chosen group is locked while its slice of the inode
+	 * bitmap is searched.
+	 */
+	grp = psfs_pick_group(parent_inode->i_sb,parent_inode,mode);
+	ino = grp ? psfs_group_alloc_ino(parent_inode->i_sb,grp) : -ENOSPC;
+	if(ino < 0)
 	{
 		PSFS_DBG_MSG("could not allocate inode no");
-		return -ENOSPC;
+		iput(inode);
+		return ino;
 	}
 	inode->i_ino = ino;
+	/*Hash it only now that it has its number, psfs_iget finds it by that.*/
+	insert_inode_hash(inode);
 	inode->i_mode = mode;
+	memset(&psi->psfs_inode,0,sizeof(psi->psfs_inode));
+	psi->psfs_inode.inode_nr = ino;
 	inode->i_mtime = inode->i_atime = inode->i_ctime = CURRENT_TIME_SEC;
-	inode->i_fop = &psfs_fops;
-	inode->i_op = &psfs_iops;
+	psfs_set_inode_ops(inode);
 	mark_inode_dirty(inode);
-        mark_buffer_dirty(inode_bmp_bh);
-	sync_dirty_buffer(inode_bmp_bh);
+	return 0;
 }
 	
 	
@@ -1,49 +1,450 @@
+/*
+ * This file is shared between the module and the userspace tools
+ * (psfs-format). When not built by kbuild, pick up the userspace
+ * definitions from psfs.h.
+ */
+#ifndef __KERNEL__
+#ifndef __USER__
+#define __USER__
+#endif
+#include <string.h>
+#include <endian.h>
+#endif /*__KERNEL__*/
 #include "psfs.h"
+#ifndef __USER__
+#include <linux/reciprocal_div.h>
+#include <linux/math64.h>
+#include <linux/vmalloc.h>
+#include <linux/buffer_head.h>
+#endif
+
+#ifdef __USER__
+#define psfs_le64_to_cpu(x)	le64toh(x)
+#define psfs_ffs64(x)		((__u64)__builtin_ctzll(x))
+#else
+#define psfs_le64_to_cpu(x)	le64_to_cpu(x)
+#define psfs_ffs64(x)		((__u64)__ffs64(x))
+#endif /*__USER__*/
+
+/*
+ * Bitmaps are a little endian bit string, bit n lives in byte n/8 at
+ * position n%8. We scan them 64 bits at a time, the buffers handed to us
+ * are not necessarily aligned nor a multiple of 8 bytes so words are
+ * loaded via memcpy and zero padded at the end.
+ */
+static inline __u64 psfs_bmap_word(const unsigned char *bitmap,__u64 nbits,
+					__u64 idx)
+{
+	__u64 word = 0;
+	__u64 nbytes = (nbits + 7) >> 3;
+	__u64 off = idx << 3;
+	memcpy(&word,bitmap + off,(nbytes - off) < 8 ? (nbytes - off) : 8);
+	return psfs_le64_to_cpu(word);
+}
+
+/*
+ * Mask of the bits of word idx which lie below nbits.
+ */
+static inline __u64 psfs_bmap_valid_mask(__u64 nbits,__u64 idx)
+{
+	__u64 left = nbits - (idx << 6);
+	return (left >= 64) ? ~0ULL : ((1ULL << left) - 1);
+}
+
+/*
+ * Find the first zero bit at or after @offset.
+ * Returns nbits if there's no zero bit.
+ */
+__u64 psfs_find_next_zero_bit(const unsigned char *bitmap,__u64 nbits,
+				__u64 offset)
+{
+	__u64 idx = offset >> 6;
+	__u64 nwords = (nbits + 63) >> 6;
+	__u64 word;
+
+	if (offset >= nbits)
+		return nbits;
+	/*Bits below offset in the first word are treated as taken.*/
+	word = psfs_bmap_word(bitmap,nbits,idx) | ((1ULL << (offset & 63)) - 1);
+	for (;;) {
+		word |= ~psfs_bmap_valid_mask(nbits,idx);
+		if (~word)
+			return (idx << 6) + psfs_ffs64(~word);
+		if (++idx >= nwords)
+			break;
+		word = psfs_bmap_word(bitmap,nbits,idx);
+	}
+	return nbits;
+}
+
+/*
+ * Find the first set bit at or after @offset.
+ * Returns nbits if there's no set bit.
+ */
+__u64 psfs_find_next_bit(const unsigned char *bitmap,__u64 nbits,
+				__u64 offset)
+{
+	__u64 idx = offset >> 6;
+	__u64 nwords = (nbits + 63) >> 6;
+	__u64 word;
+
+	if (offset >= nbits)
+		return nbits;
+	word = psfs_bmap_word(bitmap,nbits,idx) & ~((1ULL << (offset & 63)) - 1);
+	for (;;) {
+		word &= psfs_bmap_valid_mask(nbits,idx);
+		if (word)
+			return (idx << 6) + psfs_ffs64(word);
+		if (++idx >= nwords)
+			break;
+		word = psfs_bmap_word(bitmap,nbits,idx);
+	}
+	return nbits;
+}
+
+/*
+ * Find a run of @nr clear bits at or after @offset, first fit.
+ * @run_len: set to the length of the run found, which is @nr if a long
+ * enough run exists. Otherwise the longest run in the bitmap is returned
+ * so the caller can make do with a partial allocation.
+ *
+ * Returns the first bit of the run, nbits if the bitmap is full.
+ */
+__u64 psfs_find_zero_run(const unsigned char *bitmap,__u64 nbits,
+				__u64 offset,__u64 nr,__u64 *run_len)
+{
+	__u64 best = nbits,best_len = 0;
+	__u64 start,end;
+
+	while (offset < nbits) {
+		start = psfs_find_next_zero_bit(bitmap,nbits,offset);
+		if (start >= nbits)
+			break;
+		end = psfs_find_next_bit(bitmap,nbits,start);
+		if (end - start >= nr) {
+			*run_len = nr;
+			return start;
+		}
+		if (end - start > best_len) {
+			best = start;
+			best_len = end - start;
+		}
+		offset = end;
+	}
+	*run_len = best_len;
+	return best;
+}
+
+/*
+ * Set or clear @len bits starting at @start. Only the partial bytes at
+ * either end are masked, everything in between is a memset.
+ */
+static void psfs_bmap_fill(unsigned char *bitmap,__u64 start,__u64 len,
+				int set)
+{
+	__u64 end = start + len;
+	unsigned char mask;
+
+	if (!len)
+		return;
+	if ((start >> 3) == ((end - 1) >> 3)) {
+		mask = (unsigned char)(((1U << (end - start)) - 1) << (start & 7));
+		goto last_byte;
+	}
+	if (start & 7) {
+		mask = (unsigned char)(0xff << (start & 7));
+		if (set)
+			bitmap[start >> 3] |= mask;
+		else
+			bitmap[start >> 3] &= ~mask;
+		start = (start + 7) & ~7ULL;
+	}
+	memset(bitmap + (start >> 3),set ? 0xff : 0,(end >> 3) - (start >> 3));
+	if (!(end & 7))
+		return;
+	start = end & ~7ULL;
+	mask = (unsigned char)((1U << (end & 7)) - 1);
+last_byte:
+	if (set)
+		bitmap[start >> 3] |= mask;
+	else
+		bitmap[start >> 3] &= ~mask;
+}
+
+void psfs_bmap_set_range(char *bitmap,__u64 start,__u64 len)
+{
+	psfs_bmap_fill((unsigned char *)bitmap,start,len,1);
+}
+
+void psfs_bmap_clear_range(char *bitmap,__u64 start,__u64 len)
+{
+	psfs_bmap_fill((unsigned char *)bitmap,start,len,0);
+}
+
 /*
  * The maximum length of a single bitmap can be MAX_32_BIT_INTEGER(signed).
  * If you have longer bitmaps, then call this function again.
  * @bmap_len: size of bitmap in bytes.
+ * @hint: bit to start looking from, updated to the bit after the one
+ * allocated. It's only a guess, the search wraps around to bit 0 if
+ * nothing is free after it. May be NULL.
  *
  * Returns the block/inode of the block/inode allocated.
  */
-int32_t alloc_bmap(char *bitmap,int32_t bmap_len)
+int32_t alloc_bmap(char *bitmap,int32_t bmap_len,int32_t *hint)
 {
-        int32_t i=0,j=0;
-        for (;i<bmap_len;i++) {
-                if ( (bitmap[i] & 0xff) != 0xff) {
-                        for (j=0;j<8;j++) {
-                                if ( !(bitmap[i] & (1<<j))) {
-                                        bitmap[i]|=(1<<j);
-                                        break;
-                                }
-                        }
-                        return i*8+j;
-                }
-        }
-        return -1;
+	__u64 nbits = (__u64)bmap_len * 8;
+	__u64 start = 0,bit;
+
+	if (bmap_len <= 0)
+		return -1;
+	if (hint && *hint > 0 && (__u64)*hint < nbits)
+		start = *hint;
+	bit = psfs_find_next_zero_bit((unsigned char *)bitmap,nbits,start);
+	if (bit >= nbits) {
+		/*Wrap around, nothing after the hint.*/
+		if (!start)
+			return -1;
+		bit = psfs_find_next_zero_bit((unsigned char *)bitmap,start,0);
+		if (bit >= start)
+			return -1;
+	}
+	bitmap[bit/8] |= (1<<(bit%8));
+	if (hint)
+		*hint = (int32_t)(bit + 1);
+	return (int32_t)bit;
 }
 
 /*
  *Free a bit number from a bitmap given to this function.
  *Returns -1 when bit no is bigger or same as bmap_len otherwise
- *return 0 on success.
+ *return 0 on success. @hint is pulled back to bit_no so that the
+ *freed bit is found first on the next allocation, may be NULL.
  */
-int32_t free_bmap(char *bitmap,int32_t bmap_len,int32_t bit_no)
+int32_t free_bmap(char *bitmap,int32_t bmap_len,int32_t bit_no,int32_t *hint)
 {
 	int32_t which_byte = bit_no/8; /*Which byte this bit_no belongs to*/
-	if (which_byte >=bmap_len)
+	if (bit_no < 0 || which_byte >=bmap_len)
 		return -1; /*Error if bit number too great!*/
-	bitmap[which_byte]|=~(1<<(bit_no%8));
+	bitmap[which_byte]&=~(1<<(bit_no%8));
+	if (hint && bit_no < *hint)
+		*hint = bit_no;
 	return 0;
 }
-		 
-__u64 get_inode_bmp_block(struct psfs_sb_info *psbi,__u32 blocksize)
+
+/*
+ * This function attempts to allocate the requested extent.
+ * @extent: The extent that needs to be initialized.
+ * @nr_blocks: consecutive blocks requested for extent.
+ * @bitmap: The block of FS containing bitmap.
+ * @bmap_len: The length of the passed in bitmap.
+ * @hint: bit to start the search from, see alloc_bmap. May be NULL.
+ *
+ * Return Value: -1 is an error state, 0 is a success state, 1 is a partial
+ * success state returned. You must check the extent->nr_blocks to know
+ * how many blocks long is the extent if the return state is 1.
+ *
+ * The function will not attempt to move over to next bitmap if it can't
+ * fulfill the request entirely. So return value must be checked by caller.
+ * On partial success the extent is the longest free run in this bitmap.
+ *
+ * Larger extents maybe allocated by maintaining 2 extents, one will be
+ * modified by this code the other external. However appropriate locking 
+ * is the responsibility of the caller.
+ * */
+int alloc_psfs_extent(struct psfs_extent *extent, int64_t nr_blocks,
+				char *bitmap, int32_t bmap_len, int32_t *hint)
+{
+	__u64 nbits = (__u64)bmap_len * 8;
+	__u64 start = 0,bit,len = 0;
+
+	if (bmap_len <= 0 || nr_blocks <= 0)
+		return -1;
+	if (hint && *hint > 0 && (__u64)*hint < nbits)
+		start = *hint;
+	bit = psfs_find_zero_run((unsigned char *)bitmap,nbits,start,
+					nr_blocks,&len);
+	/*
+	 * Nothing long enough after the hint, look at the whole bitmap
+	 * so a partial allocation gets the longest run there is.
+	 */
+	if (len < (__u64)nr_blocks && start)
+		bit = psfs_find_zero_run((unsigned char *)bitmap,nbits,0,
+						nr_blocks,&len);
+	if (bit >= nbits || !len)
+		return -1;
+	psfs_bmap_set_range(bitmap,bit,len);
+	extent->block_no = (__u32)bit;
+	extent->length = (__u32)len;
+	if (hint)
+		*hint = (int32_t)(bit + len);
+	return !(len == (__u64)nr_blocks);
+}
+
+/*
+ * Directory name hash (32 bit FNV-1a).
+ */
+__u32 psfs_name_hash(const unsigned char *name,int len)
 {
-	return((psbi->s_ps->psfs_nr_inodes *sizeof(struct psfs_inode)/(blocksize))+
-		(psbi->s_ps->psfs_nr_inodes *sizeof(struct psfs_inode)%(blocksize)?1:0)+1);
+	__u32 hash = 2166136261U;
+	while (len-- > 0) {
+		hash ^= *name++;
+		hash *= 16777619U;
+	}
+	return hash;
 }
-__u64 get_data_bmp_block(struct psfs_sb_info *psbi,__u32 blocksize)
+
+#ifndef __USER__
+/*
+ * Work out where everything lives on this volume. Done once at mount so
+ * that each mounted volume carries its own geometry and the hot paths get
+ * away with shifts instead of 64 bit divisions.
+ *
+ * Inodes don't straddle blocks and there are blocksize/sizeof(psfs_inode)
+ * of them per block, which is not a power of 2, so that one is divided
+ * with a precomputed reciprocal.
+ */
+void psfs_init_geometry(struct super_block *sb)
+{
+	struct psfs_sb_info *psbi = PSFS_SB(sb);
+	__u64 nr_inodes = psbi->s_ps->psfs_nr_inodes;
+	__u64 inode_table_blocks;
+
+	psbi->bits_per_block_shift = sb->s_blocksize_bits + 3;
+	psbi->bits_per_block_mask = (1ULL << psbi->bits_per_block_shift) - 1;
+	psbi->inodes_per_block = sb->s_blocksize/sizeof(struct psfs_inode);
+	psbi->inodes_per_block_rcp = reciprocal_value(psbi->inodes_per_block);
+
+	inode_table_blocks = div_u64(nr_inodes + psbi->inodes_per_block - 1,
+					psbi->inodes_per_block);
+	psbi->inode_table_block = PSFS_SUPERBLOCK + 1;
+	psbi->inode_bmp_block = psbi->inode_table_block + inode_table_blocks;
+	psbi->data_bmp_block = psbi->inode_bmp_block +
+		((nr_inodes + psbi->bits_per_block_mask) >> psbi->bits_per_block_shift);
+}
+
+/*
+ * Bitmap block cache.
+ *
+ * Bitmap blocks are read once, on first use, and the buffer_heads stay
+ * pinned in psfs_sb_info until unmount. Allocators only mark them dirty and
+ * leave it to the regular buffer writeback to push them out in batches
+ * instead of a synchronous read and write per operation.
+ */
+int psfs_init_bmap_cache(struct super_block *sb)
 {
-	return((psbi->s_ps->psfs_nr_inodes/(blocksize*8)+ (psbi->s_ps->psfs_nr_inodes %(blocksize*8)?1:0))+psfs_inode_bmp_block);
-	
+	struct psfs_sb_info *psbi = PSFS_SB(sb);
+	__u64 size;
+
+	spin_lock_init(&psbi->bmap_lock);
+	psbi->nr_inode_bmap_blocks = (psbi->s_ps->psfs_nr_inodes +
+		psbi->bits_per_block_mask) >> psbi->bits_per_block_shift;
+	psbi->nr_data_bmap_blocks = (psbi->s_ps->psfs_nr_blocks +
+		psbi->bits_per_block_mask) >> psbi->bits_per_block_shift;
+
+	size = psbi->nr_inode_bmap_blocks * sizeof(struct buffer_head *);
+	psbi->inode_block_bmap = vmalloc(size);
+	if (!psbi->inode_block_bmap)
+		goto nomem;
+	memset(psbi->inode_block_bmap,0,size);
+	size = psbi->nr_data_bmap_blocks * sizeof(struct buffer_head *);
+	psbi->data_block_bmap = vmalloc(size);
+	if (!psbi->data_block_bmap)
+		goto nomem;
+	memset(psbi->data_block_bmap,0,size);
+	return 0;
+nomem:
+	psfs_destroy_bmap_cache(psbi);
+	return -ENOMEM;
+}
+
+void psfs_destroy_bmap_cache(struct psfs_sb_info *psbi)
+{
+	__u64 i;
+	if (psbi->inode_block_bmap) {
+		for (i = 0;i < psbi->nr_inode_bmap_blocks;i++)
+			brelse(psbi->inode_block_bmap[i]);
+		vfree(psbi->inode_block_bmap);
+		psbi->inode_block_bmap = NULL;
+	}
+	if (psbi->data_block_bmap) {
+		for (i = 0;i < psbi->nr_data_bmap_blocks;i++)
+			brelse(psbi->data_block_bmap[i]);
+		vfree(psbi->data_block_bmap);
+		psbi->data_block_bmap = NULL;
+	}
+}
+
+/*
+ * Get the idx'th block of the inode (PSFS_INODE_BMAP) or data
+ * (PSFS_DATA_BMAP) bitmap. The buffer is owned by the cache, don't brelse
+ * it. Returns NULL on I/O error.
+ */
+struct buffer_head *psfs_bmap_bh(struct super_block *sb,int which,__u64 idx)
+{
+	struct psfs_sb_info *psbi = PSFS_SB(sb);
+	struct buffer_head **slot,*bh;
+	__u64 block;
+
+	if (which == PSFS_INODE_BMAP) {
+		if (idx >= psbi->nr_inode_bmap_blocks)
+			return NULL;
+		slot = &psbi->inode_block_bmap[idx];
+		block = psbi->inode_bmp_block + idx;
+	}
+	else {
+		if (idx >= psbi->nr_data_bmap_blocks)
+			return NULL;
+		slot = &psbi->data_block_bmap[idx];
+		block = psbi->data_bmp_block + idx;
+	}
+	bh = ACCESS_ONCE(*slot);
+	if (bh)
+		return bh;
+	bh = sb_bread(sb,block);
+	if (!bh)
+		return NULL;
+	spin_lock(&psbi->bmap_lock);
+	if (*slot) {
+		/*Somebody beat us to it.*/
+		spin_unlock(&psbi->bmap_lock);
+		brelse(bh);
+		return *slot;
+	}
+	*slot = bh;
+	spin_unlock(&psbi->bmap_lock);
+	return bh;
+}
+
+/*
+ * sb_bread() and sb_breadahead() for metadata. Only blocks which aren't
+ * in the buffer cache already count as PSFS_STAT_SYNC_META_READS and
+ * PSFS_STAT_ASYNC_META_READS.
+ */
+struct buffer_head *psfs_meta_bread(struct super_block *sb,sector_t block)
+{
+	struct buffer_head *bh = sb_getblk(sb,block);
+
+	if (unlikely(!bh) || bh_uptodate_or_lock(bh))
+		return bh;
+	psfs_stat_inc(PSFS_SB(sb),PSFS_STAT_SYNC_META_READS);
+	if (bh_submit_read(bh)) {
+		brelse(bh);
+		return NULL;
+	}
+	return bh;
+}
+
+void psfs_meta_breadahead(struct super_block *sb,sector_t block)
+{
+	struct buffer_head *bh = sb_getblk(sb,block);
+
+	if (unlikely(!bh))
+		return;
+	if (!buffer_uptodate(bh)) {
+		psfs_stat_inc(PSFS_SB(sb),PSFS_STAT_ASYNC_META_READS);
+		ll_rw_block(READA,1,&bh);
+	}
+	brelse(bh);
 }
+#endif /*__USER__*/
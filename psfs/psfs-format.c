@@ -1,12 +1,17 @@
+#define _GNU_SOURCE /*O_DIRECT*/
 #include <stdio.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <linux/falloc.h>
 #include <errno.h>
 #include <linux/fs.h> /*This is for BLKGETSIZE64*/
 #include <stdlib.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include <time.h>
 /*
  * Must be included after linux/fs.h to avoid redeclaration
  * error for types.
@@ -16,71 +21,16 @@
 #include "psfs.h"
 #endif
 
-#define OPTSTRING	"b:i:N"
-
+#define OPTSTRING	"b:i:N:L:g:l"
 
 /*
- * The maximum length of a single bitmap can be MAX_32_BIT_INTEGER(signed).
- * If you have longer bitmaps, then call this function again.
- * @bmap_len: size of bitmap in bytes.
- *
- * Returns the block/inode of the block/inode allocated.
+ * Metadata regions are zeroed with pwritev, MKFS_IO_IOVECS chunks of
+ * MKFS_IO_CHUNK bytes per call, so a call covers up to 64MiB.
  */
-static int32_t alloc_bmap(char *bitmap,int32_t bmap_len)
-{
-	int32_t i=0,j=0;
-	for (;i<bmap_len;i++) {
-		if ( (bitmap[i] & 0xff) != 0xff) {
-			for (j=0;j<8;j++) {
-				if ( !(bitmap[i] & (1<<j))) {
-					bitmap[i]|=(1<<j);
-					break;
-				}
-			}
-			return i*8+j;
-		}
-	}
-	return -1;
-}
+#define MKFS_IO_CHUNK	(1 << 20)
+#define MKFS_IO_IOVECS	64
+#define MKFS_IO_ALIGN	4096
 
-/*
- * This function attempts to allocate the requested extent.
- * @extent: The extent that needs to be initialized.
- * @nr_blocks: consecutive blocks requested for extent.
- * @bitmap: The block of FS containing bitmap.
- * @bmap_len: The length of the passed in bitmap.
- *
- * Return Value: -1 is an error state, 0 is a success state, 1 is a partial
- * success state returned. You must check the extent->nr_blocks to know
- * how many blocks long is the extent if the return state is 1.
- *
- * The function will not attempt to move over to next bitmap if it can't
- * fulfill the request entirely. So return value must be checked by caller.
- *
- * Larger extents maybe allocated by maintaining 2 extents, one will be
- * modified by this code the other external. However appropriate locking 
- * is the responsibility of the caller.
- * */
-static int alloc_psfs_extent(struct psfs_extent *extent, int64_t nr_blocks,
-				char *bitmap, int32_t bmap_len)
-{
-	int64_t blocks_alloced = 0;
-	int32_t start_block = -1;
-	while(blocks_alloced<nr_blocks)
-	{
-		if (start_block < 0) {
-			start_block = alloc_bmap(bitmap,bmap_len);
-			if (start_block < 0)
-				return -1;
-		}
-		else if (alloc_bmap(bitmap,bmap_len) < 0)
-			break;
-		blocks_alloced++;
-	}
-	extent->block_no = start_block;
-	extent->length = blocks_alloced;
-	return !(blocks_alloced==nr_blocks);
-}
 
 /*
  *Supported options for filesystems include the number of inodes,
@@ -150,24 +100,152 @@ static inline u_int64_t inode_block_from_ino(u_int64_t ino,struct psfs_super_blo
 static inline u_int32_t inode_offset_from_ino(u_int64_t ino,struct psfs_super_block *psfs_sb) {
 	u_int64_t max_inodes_per_block = be32_to_cpu(psfs_sb->psfs_block_size)/sizeof(struct psfs_inode);
 	ino = ino-(max_inodes_per_block * inode_block_from_ino(ino,psfs_sb));
-	printf ("Offset is %u\n",( ino % max_inodes_per_block)*sizeof(struct psfs_inode));
+	printf ("Offset is %u\n",(u_int32_t)(( ino % max_inodes_per_block)*sizeof(struct psfs_inode)));
 	return ( ino % max_inodes_per_block)*sizeof(struct psfs_inode);
 }
 
+/*
+ * Blocks of [start,start+len) which fall in [first,first+nr).
+ */
+static u_int64_t range_overlap(u_int64_t start,u_int64_t len,
+				u_int64_t first,u_int64_t nr)
+{
+	u_int64_t lo = start > first ? start : first;
+	u_int64_t hi = (start+len) < (first+nr) ? (start+len) : (first+nr);
+	return hi > lo ? hi - lo : 0;
+}
+
+/*
+ * Fill in the group descriptor table. Everything below meta_blocks is
+ * taken by the superblock, inode table, bitmaps and this table, the root
+ * directory took one extent and one inode.
+ * @super and @root are in big endian.
+ */
+static int write_group_descs(int dev_fd,struct psfs_super_block *super,
+				u_int32_t block_size,u_int64_t inode_bmap_block,
+				u_int64_t data_bmap_block,u_int64_t meta_blocks,
+				struct psfs_inode *root,int32_t root_ino)
+{
+	u_int32_t nr_groups = be32_to_cpu(super->psfs_nr_groups);
+	u_int32_t bpg = be32_to_cpu(super->psfs_blocks_per_group);
+	u_int32_t ipg = be32_to_cpu(super->psfs_inodes_per_group);
+	u_int64_t nr_blocks = be64_to_cpu(super->psfs_nr_blocks);
+	u_int64_t bits_per_block = block_size*8;
+	u_int64_t table_len = (u_int64_t)nr_groups*sizeof(struct psfs_group_desc);
+	struct psfs_group_desc *table;
+	u_int32_t g;
+
+	table_len = (table_len + block_size - 1)/block_size*block_size;
+	table = calloc(1,table_len);
+	if (!table) {
+		printf("Unable to allocate memory for group descriptors!\n");
+		return -1;
+	}
+	for (g = 0;g < nr_groups;g++) {
+		u_int64_t first = (u_int64_t)g*bpg;
+		u_int64_t nr = (nr_blocks - first) < bpg ? (nr_blocks - first) : bpg;
+		u_int64_t first_ino = (u_int64_t)g*ipg;
+		u_int64_t used = range_overlap(0,meta_blocks,first,nr)+
+			range_overlap(be32_to_cpu(root->psfs_extent[0].block_no),
+				be32_to_cpu(root->psfs_extent[0].length),first,nr);
+
+		table[g].gd_block_bitmap = cpu_to_be64(data_bmap_block + first/bits_per_block);
+		table[g].gd_inode_bitmap = cpu_to_be64(inode_bmap_block + first_ino/bits_per_block);
+		table[g].gd_inode_bitmap_off = cpu_to_be32((first_ino%bits_per_block)/8);
+		table[g].gd_free_blocks = cpu_to_be32(nr - used);
+		table[g].gd_free_inodes = cpu_to_be32(ipg -
+			(root_ino >= first_ino && root_ino < first_ino + ipg ? 1 : 0));
+		table[g].gd_flags = 0;
+	}
+	if (lseek(dev_fd,(off_t)be64_to_cpu(super->psfs_group_desc_block)*block_size,SEEK_SET) < 0 ||
+		write(dev_fd,table,table_len) < 0) {
+		perror("FATAL Error: While writing group descriptors\n");
+		free(table);
+		return -1;
+	}
+	free(table);
+	return 0;
+}
+
+/*
+ * Zero nr blocks starting at block. All iovecs point at the same zeroed
+ * chunk, which is aligned so this works on an O_DIRECT descriptor.
+ */
+static int write_zero_blocks(int fd,u_int64_t block,u_int64_t nr,
+				u_int32_t block_size)
+{
+	static void *zero_chunk;
+	struct iovec iov[MKFS_IO_IOVECS];
+	off_t off = (off_t)block*block_size;
+	u_int64_t left = nr*block_size;
+
+	if (!zero_chunk) {
+		if (posix_memalign(&zero_chunk,MKFS_IO_ALIGN,MKFS_IO_CHUNK)) {
+			zero_chunk = NULL;
+			errno = ENOMEM;
+			return -1;
+		}
+		memset(zero_chunk,0,MKFS_IO_CHUNK);
+	}
+	while (left) {
+		u_int64_t batch = 0;
+		ssize_t ret;
+		int i;
+		for (i = 0;i < MKFS_IO_IOVECS && left;i++) {
+			iov[i].iov_base = zero_chunk;
+			iov[i].iov_len = left < MKFS_IO_CHUNK ? left : MKFS_IO_CHUNK;
+			left -= iov[i].iov_len;
+			batch += iov[i].iov_len;
+		}
+		ret = pwritev(fd,iov,i,off);
+		if (ret <= 0) {
+			if (!ret)
+				errno = EIO;
+			return -1;
+		}
+		/*Short write, the rest goes with the next batch.*/
+		left += batch - ret;
+		off += ret;
+	}
+	return 0;
+}
+
+/*
+ * Zero nr blocks of an image file by punching a hole, the image stays
+ * sparse. Fails if the file system underneath can't punch holes.
+ */
+static int punch_zero_blocks(int fd,u_int64_t block,u_int64_t nr,
+				u_int32_t block_size)
+{
+	if (!nr)
+		return 0;
+	return fallocate(fd,FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+			(off_t)block*block_size,(off_t)nr*block_size);
+}
+
 int format_psfs(const char *device, u_int32_t block_size, u_int64_t nr_inodes,
-			u_int64_t nr_blocks, u_int32_t min_extent_length)
+			u_int64_t nr_blocks, u_int32_t min_extent_length,
+			u_int32_t blocks_per_group,int lazy_itable)
 {
 	int dev_fd=open(device,O_RDWR);
+	int bulk_fd,is_image,created = 0;
+	struct stat st;
 	char *fs_block_buffer;
-	off_t disk_offset = 0;
 	int32_t ino = -1;
 	time_t tm;
-	u_int64_t inodes_written = 0,inode_bmap_blocks,bmap_blocks;
+	u_int64_t inode_bmap_blocks,bmap_blocks;
 	u_int64_t total_blocks_written = 0;
 	u_int64_t data_bmap_block;
 	u_int64_t inode_bmap_block;
 	u_int64_t tmp_var;
+	u_int32_t nr_groups = 0,inodes_per_group = 0;
+	u_int64_t group_desc_block = 0,group_desc_blocks = 0;
 
+	/*A new image file is created, -N gives its size.*/
+	if (dev_fd < 0 && errno == ENOENT) {
+		dev_fd = open(device,O_RDWR|O_CREAT|O_EXCL,0644);
+		created = dev_fd >= 0;
+	}
 	if (dev_fd < 0) {
 		printf("Error opening device, open returned with status %d\n",errno);
 		perror("FATAL:");
@@ -176,22 +254,48 @@ int format_psfs(const char *device, u_int32_t block_size, u_int64_t nr_inodes,
 	/*long nr_512sectors;*/
 	u_int64_t nr_512sectors;
 	u_int32_t scaling_factor;
-	if (ioctl(dev_fd,BLKGETSIZE64,&nr_512sectors) < 0 )
+	/*
+	 *Check if default values are to be used.
+	 */
+	if (!block_size)
+		block_size = PSFS_DEFAULT_BLKSIZE;
+	if (fstat(dev_fd,&st) < 0) {
+		perror("FATAL Error: Unable to stat device");
+		return -1;
+	}
+	is_image = S_ISREG(st.st_mode);
+	if (is_image) {
+		/*
+		 * An image file is as big as it is, unless -N asks for more
+		 * in which case it's grown. That only moves the end of the
+		 * file, no blocks get allocated.
+		 */
+		nr_512sectors = st.st_size;
+		if (nr_blocks && nr_blocks*block_size > nr_512sectors) {
+			nr_512sectors = nr_blocks*block_size;
+			if (ftruncate(dev_fd,nr_512sectors) < 0) {
+				perror("FATAL Error: Unable to grow image");
+				return -1;
+			}
+		}
+		if (!nr_512sectors) {
+			printf("Image %s is empty, give its size with -N\n",device);
+			if (created)
+				unlink(device);
+			return -1;
+		}
+	}
+	else if (ioctl(dev_fd,BLKGETSIZE64,&nr_512sectors) < 0 )
 	{
 		printf("Error getting device size, ioctl returned with status %d\n",errno);
 		perror("FATAL:");
 		return -1;
 	}
 	nr_512sectors/=KERNEL_SECTOR_SIZE;
-	printf("Total 512 sectors on disk are %llu\n",nr_512sectors);
-	/*
-	 *Check if default values are to be used.
-	 */
-	if (!block_size)
-		block_size = PSFS_DEFAULT_BLKSIZE;
+	printf("Total 512 sectors on disk are %llu\n",(unsigned long long)nr_512sectors);
 
 	scaling_factor=block_size/KERNEL_SECTOR_SIZE;
-	printf(PSFS_DBG_VAR("%016llX \n",scaling_factor));
+	printf(PSFS_DBG_VAR("%08X \n",scaling_factor));
 	if (!nr_blocks)
 		nr_blocks = (nr_512sectors)/scaling_factor;
 	printf (PSFS_DBG_VAR("%lu \n",nr_blocks));
@@ -202,9 +306,29 @@ int format_psfs(const char *device, u_int32_t block_size, u_int64_t nr_inodes,
 		nr_inodes = nr_blocks/10;
 	if (!min_extent_length)
 		min_extent_length=PSFS_DEFAULT_EXTENT_LEN;
+	/*
+	 * Allocation groups. A group's block bitmap must be whole blocks
+	 * and groups must not share a byte of the inode bitmap, so round
+	 * the inodes up to a multiple of 8 per group.
+	 */
+	if (blocks_per_group) {
+		if (blocks_per_group % (block_size*8)) {
+			printf("Blocks per group must be a multiple of %u\n",block_size*8);
+			return -1;
+		}
+		nr_groups = nr_blocks/blocks_per_group + (nr_blocks%blocks_per_group?1:0);
+		inodes_per_group = nr_inodes/nr_groups + (nr_inodes%nr_groups?1:0);
+		inodes_per_group = (inodes_per_group + 7) & ~7U;
+		nr_inodes = (u_int64_t)inodes_per_group * nr_groups;
+		group_desc_blocks = (nr_groups*sizeof(struct psfs_group_desc))/block_size +
+			((nr_groups*sizeof(struct psfs_group_desc))%block_size?1:0);
+		printf(PSFS_DBG_VAR("%u \n",nr_groups));
+		printf(PSFS_DBG_VAR("%u \n",inodes_per_group));
+	}
 
 	struct psfs_super_block super;
 	struct psfs_inode inode;
+	memset(&super,0,sizeof(super));
 	memset(&inode,0,sizeof(inode));
 	fs_block_buffer = calloc(1,block_size);
 	if (!fs_block_buffer) {
@@ -221,8 +345,8 @@ int format_psfs(const char *device, u_int32_t block_size, u_int64_t nr_inodes,
 			/*
 			 * Number of blocks taken by psfs_inode structures.
 			 * */
-			(nr_inodes *sizeof(struct psfs_inode)/block_size)+
-			(nr_inodes *sizeof(struct psfs_inode)%block_size?1:0)
+			(nr_inodes/(block_size/sizeof(struct psfs_inode)))+
+			(nr_inodes%(block_size/sizeof(struct psfs_inode))?1:0)
 					+
 			/*
 			 * Number of blocks taken by block bitmaps.
@@ -233,6 +357,11 @@ int format_psfs(const char *device, u_int32_t block_size, u_int64_t nr_inodes,
 			 * */
 			(nr_inodes/(block_size*8)+ (nr_inodes %(block_size*8)?1:0))
 			 		+
+			/*
+			 * Group descriptor table, 0 without groups.
+			 * */
+			group_desc_blocks
+					+
 			/*
 			 * The super block always takes up the first block, so
 			 * accomodate it as well.
@@ -243,6 +372,23 @@ int format_psfs(const char *device, u_int32_t block_size, u_int64_t nr_inodes,
 	super.psfs_super_flags = 0;
 	super.psfs_magic = cpu_to_be32(PSFS_MAGIC);
 	super.psfs_block_size = cpu_to_be32(block_size);
+	if (nr_groups) {
+		super.psfs_super_flags = cpu_to_be32(PSFS_SUPER_AG);
+		super.psfs_nr_groups = cpu_to_be32(nr_groups);
+		super.psfs_blocks_per_group = cpu_to_be32(blocks_per_group);
+		super.psfs_inodes_per_group = cpu_to_be32(inodes_per_group);
+		/*The descriptor table is the last of the boot blocks.*/
+		group_desc_block = be32_to_cpu(super.psfs_nr_boot_blocks) - group_desc_blocks;
+		super.psfs_group_desc_block = cpu_to_be64(group_desc_block);
+	}
+	/*
+	 * Lazy init, the inode table is left alone and zeroed by the module
+	 * after mount.
+	 */
+	if (lazy_itable) {
+		super.psfs_super_flags |= cpu_to_be32(PSFS_SUPER_LAZY_ITABLE);
+		super.psfs_itable_zeroed = 0;
+	}
 	memcpy(fs_block_buffer,&super,sizeof(super));
 	/*
 	 * Write the super block. The super block also takes up one whole FS block
@@ -254,139 +400,89 @@ int format_psfs(const char *device, u_int32_t block_size, u_int64_t nr_inodes,
 	}
 	total_blocks_written++; /* increment total blocks written.*/
 	/*
-	 * Write the inodes right after the super block's block. So inodes are always
-	 * in a fixed location, i.e. right after the super block's block.
+	 * The rest of the metadata, in this order: the inode table right
+	 * after the super block's block, so inodes are always in a fixed
+	 * location, then the inode bitmap, the block bitmap and room for the
+	 * group descriptors. It all starts out zeroed, the bits and the root
+	 * directory are filled in below, so write it as one region with big
+	 * direct writes rather than a write() per block. Fall back to the
+	 * buffered descriptor when O_DIRECT isn't supported. With lazy init
+	 * the region starts at the inode bitmap. On an image file nothing is
+	 * written at all, the region is punched out so the image stays
+	 * sparse.
 	 */
-	while (inodes_written<nr_inodes) {
-		int buffer_left = block_size;
-		int buffer_inodes = 0;
-		memset(fs_block_buffer,0,block_size);
-		while (buffer_left>=sizeof(inode) && inodes_written < nr_inodes) {
-			memcpy(fs_block_buffer+sizeof(inode)*buffer_inodes,&inode,sizeof(inode));
-			buffer_left -= sizeof(inode);
-			buffer_inodes++;
-			inodes_written++;
-		}
-		if (write(dev_fd,fs_block_buffer,block_size) < 0)
-		{
-			perror("FATAL Error while writing inodes:");
+	inode_bmap_block = total_blocks_written +
+		(nr_inodes/(block_size/sizeof(struct psfs_inode)) +
+		 (nr_inodes%(block_size/sizeof(struct psfs_inode))?1:0));
+	inode_bmap_blocks = (nr_inodes/(block_size*8)+ (nr_inodes %(block_size*8)?1:0));
+	data_bmap_block = inode_bmap_block + inode_bmap_blocks;
+	bmap_blocks = nr_blocks/(block_size*8)+ (nr_blocks %(block_size*8)?1:0);
+	printf(PSFS_DBG_VAR("%llu \n",(unsigned long long)bmap_blocks));
+	if (lazy_itable)
+		total_blocks_written = inode_bmap_block;
+	tmp_var = data_bmap_block + bmap_blocks + group_desc_blocks -
+		total_blocks_written;
+	if (!is_image ||
+		punch_zero_blocks(dev_fd,total_blocks_written,tmp_var,block_size) < 0) {
+		bulk_fd = open(device,O_WRONLY|O_DIRECT);
+		if (bulk_fd < 0)
+			bulk_fd = dev_fd;
+		if (write_zero_blocks(bulk_fd,total_blocks_written,tmp_var,block_size) < 0) {
+			perror("FATAL Error while writing metadata");
 			return -1;
 		}
-		total_blocks_written++; /* increment total blocks written.*/
+		if (bulk_fd != dev_fd)
+			close(bulk_fd);
 	}
-	inode_bmap_block = total_blocks_written;/*We save the block number of inode bmap*/
+	total_blocks_written += tmp_var;
+	 if (total_blocks_written != be32_to_cpu(super.psfs_nr_boot_blocks)) {
+		printf("FATAL Error, wrote %llu metadata blocks, expected %u\n",
+			(unsigned long long)total_blocks_written,be32_to_cpu(super.psfs_nr_boot_blocks));
+		return -1;
+	 }
 	/*
-	 * Write the inode's bitmap. Figure out how many FS blocks are required and just
-	 * zero them out.
+	 * Mark what's taken in the data bitmap: the metadata, blocks
+	 * [0,total_blocks_written), and right after it the root directory's
+	 * extent. Only the bitmap blocks covering those are built, as whole
+	 * byte ranges, and written back in one go. The rest of the bitmap
+	 * was zeroed with the metadata above.
 	 */
+	struct psfs_inode *root=&inode;
+	u_int64_t root_len = min_extent_length*500;
+	u_int64_t used_blocks,used_bmap_blocks;
+	char *bmap_buffer;
 
-	 /*Reusing the inodes_written variable here.*/
-	 inodes_written = 0;
-	 inode_bmap_blocks = (nr_inodes/(block_size*8)+ (nr_inodes %(block_size*8)?1:0));
-	 memset(fs_block_buffer,0,block_size);
-	 while (inodes_written < inode_bmap_blocks) {
-	 	if (write(dev_fd,fs_block_buffer,block_size) < 0) {
-			perror("FATAL Error while writing inode bitmap");
-			return -1;
-		}
-		inodes_written++;
-		total_blocks_written++; /* increment total blocks written.*/
-	 }
-	 /*
-	  * Till now the super block and the inode blocks and inode bmap 
-	  * have been written.
-	  * We record here the next block address since now we'll write the
-	  * block map and we would need to modify the allocated blocks bmap
-	  * after we are done.
-	  */
-	 data_bmap_block = total_blocks_written; /*We save the block number for bmap*/
-	 bmap_blocks = nr_blocks/(block_size*8)+ (nr_blocks %(block_size*8)?1:0);
-	 printf(PSFS_DBG_VAR("%llu \n",bmap_blocks));
-	 memset(fs_block_buffer,0,block_size); /*Zero out the block for bitmap*/
-	 tmp_var=bmap_blocks;
-	 while (tmp_var) {
-	 	if (write(dev_fd,fs_block_buffer,block_size) < 0) {
-			perror("FATAL Error while writing block bitmap");
-			return -1;
-		}
-		tmp_var--;
-		total_blocks_written++;
-	 }
-	 /*
-	  * Modify the bitmap for blocks allocated.
-	  * */
-	tmp_var = total_blocks_written;
-	printf (PSFS_DBG_VAR("% llu\n",total_blocks_written));
-	u_int64_t blocks_used = 0;
-	memset(fs_block_buffer,0,block_size);
-	printf(PSFS_DBG_VAR("%llu \n",tmp_var));
-	while (tmp_var && (blocks_used < bmap_blocks)) {
-#ifdef PSFS_DEBUG
-		int64_t block_nr_alloced;
-		if ( (block_nr_alloced=alloc_bmap(fs_block_buffer,block_size)) < 0) {
-#else
-		if (alloc_bmap(fs_block_buffer,block_size) < 0) {
-#endif
-			/*
-			 * Write this bmap first to its position.
-			 * */
-			if (llseek(dev_fd,(data_bmap_block+blocks_used)*block_size,SEEK_SET) < 0)
-			{
-				perror("FATAL Error while seeking in device:");
-				return -1;
-			}
-			if (write(dev_fd,fs_block_buffer,block_size) < 0)
-			{
-				perror("FATAL Error writing back block bitmap:");
-				return -1;
-			}
-			blocks_used++;
-			memset(fs_block_buffer,0,block_size); /*Clean the slate for next bmap block*/
-		}
-		else {
-			tmp_var--;
-#ifdef PSFS_DEBUG
-			printf ("Allocated block number = %llu\n",block_nr_alloced);
-#endif
-		}
-	}
-	/*
-	 * Check if we were really able to modify the bitmap. That is all bitmap
-	 * allocations were done successfully. The last bitmap block still has to be
-	 * written to disk.
-	 * */
-	if(tmp_var)
-	{
-		printf(PSFS_DBG_VAR("%llu \n",tmp_var));
+	memset(root,0,sizeof(*root));
+	if (total_blocks_written >= nr_blocks) {
 		printf("FATAL Error, block allocation failed!!! NOT ENOUGH BLOCKS!!\n");
 		return -1;
 	}
-	else if (write(dev_fd,fs_block_buffer,block_size) < 0)
-	{
-		perror("FATAL Error writing back block bitmap:");
+	if (root_len > nr_blocks - total_blocks_written)
+		root_len = nr_blocks - total_blocks_written;
+	root->psfs_extent[0].block_no = total_blocks_written;
+	root->psfs_extent[0].length = root_len;
+	used_blocks = total_blocks_written + root_len;
+	used_bmap_blocks = (used_blocks + block_size*8 - 1)/(block_size*8);
+	printf(PSFS_DBG_VAR("%llu \n",(unsigned long long)used_bmap_blocks));
+	bmap_buffer = calloc(used_bmap_blocks,block_size);
+	if (!bmap_buffer) {
+		printf("Unable to allocate memory for the block bitmap!\n");
 		return -1;
 	}
-	/*
-	 * Now we've set all the blocks we've taken. Setup the root directory
-	 * and allocate it an extent and an inode.
-	 * @blocks_used :The number of bitmap blocks used.
-	 * @fs_block_buffer: The last bitmap block that was written to disk.
-	 * */
-
-	struct psfs_inode *root=&inode;
-	memset(root,0,sizeof(*root));
-	
-	if (alloc_psfs_extent (&root->psfs_extent[0],min_extent_length*500,fs_block_buffer,block_size) < 0) {
-		printf("Unable to allocate extent for root directory!!!\n");
+	psfs_bmap_set_range(bmap_buffer,0,used_blocks);
+	if (pwrite(dev_fd,bmap_buffer,used_bmap_blocks*block_size,
+			(off_t)data_bmap_block*block_size) < 0) {
+		perror("FATAL Error writing back block bitmap:");
+		free(bmap_buffer);
 		return -1;
 	}
-	root->psfs_extent[0].block_no+=blocks_used*(block_size * 8);
+	free(bmap_buffer);
 	/*
 	 * Get an inode, set the bit in inode bitmap. Grab an extent
 	 * and give it the root directory inode number.
 	 * */
 
-	if (llseek(dev_fd, (inode_bmap_block)*block_size,SEEK_SET) < 0) {
+	if (lseek(dev_fd,(off_t)inode_bmap_block*block_size,SEEK_SET) < 0) {
 		perror("FATAL Error: Unable to seek into device for root directory!!!\n");
 		return -1;
 	}
@@ -394,7 +490,7 @@ int format_psfs(const char *device, u_int32_t block_size, u_int64_t nr_inodes,
 	 * There are no inodes allocated yet so we don't need to read from device.
 	 * */
 	memset(fs_block_buffer,0,block_size);
-	if ( (ino = alloc_bmap(fs_block_buffer,block_size)) < 0) {
+	if ( (ino = alloc_bmap(fs_block_buffer,block_size,NULL)) < 0) {
 		perror("FATAL Error: Unable to allocate an inode from bitmap for root directory!\n");
 		return -1;
 	}
@@ -435,7 +531,7 @@ int format_psfs(const char *device, u_int32_t block_size, u_int64_t nr_inodes,
 	root->type = cpu_to_be32(S_IFDIR|0755);
 	memcpy(fs_block_buffer+inode_offset_from_ino(ino,&super),root,sizeof(*root));
 	
-	printf(PSFS_DBG_VAR("%016llX\n",root->size));
+	printf(PSFS_DBG_VAR("%016llX\n",(unsigned long long)root->size));
 	printf(PSFS_DBG_VAR("=%x \n",root->flags));
 	printf(PSFS_DBG_VAR("=%x \n",root->psfs_extent[0].block_no));
 	printf(PSFS_DBG_VAR("=%x \n",root->psfs_extent[0].length));
@@ -446,7 +542,7 @@ int format_psfs(const char *device, u_int32_t block_size, u_int64_t nr_inodes,
 	 *after the first block, we just add 1 to the block number returned by
 	 *inode_block_from_ino.
 	 */
-	if (llseek(dev_fd,(inode_block_from_ino(ino,&super)+1)*block_size,SEEK_SET) < 0) {
+	if (lseek(dev_fd,(off_t)(inode_block_from_ino(ino,&super)+1)*block_size,SEEK_SET) < 0) {
 		perror("FATAL Error: While seeking into device\n");
 		return -1;
 	}
@@ -455,7 +551,7 @@ int format_psfs(const char *device, u_int32_t block_size, u_int64_t nr_inodes,
 		return -1;
 	}
 	
-	if (llseek(dev_fd,(be32_to_cpu(root->psfs_extent[0].block_no))*block_size,SEEK_SET) < 0) {
+	if (lseek(dev_fd,(off_t)be32_to_cpu(root->psfs_extent[0].block_no)*block_size,SEEK_SET) < 0) {
 	 	perror("FATAL Error: While seeking into device\n");
 		return -1;
 	}
@@ -467,20 +563,29 @@ int format_psfs(const char *device, u_int32_t block_size, u_int64_t nr_inodes,
 	 	perror("FATAL Error: While writing dirent ..\n");
 		return -1;
 	}
-	printf(PSFS_DBG_VAR("%llX\n",super.psfs_nr_blocks));
-	printf(PSFS_DBG_VAR("%llX\n",super.psfs_nr_inodes));
+	if (nr_groups && write_group_descs(dev_fd,&super,block_size,
+				inode_bmap_block,data_bmap_block,
+				total_blocks_written,root,ino) < 0)
+		return -1;
+	printf(PSFS_DBG_VAR("%llX\n",(unsigned long long)super.psfs_nr_blocks));
+	printf(PSFS_DBG_VAR("%llX\n",(unsigned long long)super.psfs_nr_inodes));
 	printf(PSFS_DBG_VAR("%X\n",super.psfs_boot_block));
 	printf(PSFS_DBG_VAR("%X\n",super.psfs_nr_boot_blocks));
 	printf(PSFS_DBG_VAR("%X\n",super.psfs_min_extent_length));
 	printf(PSFS_DBG_VAR("%X\n",super.psfs_super_flags));
 	printf(PSFS_DBG_VAR("%X\n",super.psfs_magic));
 	printf(PSFS_DBG_VAR("%X\n",super.psfs_block_size));
+	if (fsync(dev_fd) < 0) {
+		perror("FATAL Error: While syncing device\n");
+		return -1;
+	}
 	return 0;
 }
 
 int main(int argc,char *argv[])
 {
-	int32_t block_size=0,extent_length=0;
+	int32_t block_size=0,extent_length=0,blocks_per_group=0;
+	int lazy_itable=0;
 	int64_t nr_blocks=0,nr_inodes=0;
 	extern int optind;
 	char *strtol_ptr;
@@ -488,7 +593,7 @@ int main(int argc,char *argv[])
 	optind=2; /*The first is the device name, next comes options.*/
 	if(argc<2)
 	{
-		printf("Usage %s <device_file> [-b block_size] [-i nr_inodes] [-N nr_blocks] [-L min extent length]\n",__progname);
+		printf("Usage %s <device_file|image_file> [-b block_size] [-i nr_inodes] [-N nr_blocks] [-L min extent length] [-g blocks_per_group] [-l]\n",__progname);
 		exit(EXIT_FAILURE);
 	}
 	while ( (c = getopt(argc,argv,OPTSTRING)) != -1) {
@@ -514,7 +619,7 @@ int main(int argc,char *argv[])
 				}
 				break;
 			case 'N':
-				if ( (nr_blocks = (int32_t)strtoll(optarg,&strtol_ptr,10)) < 0) {
+				if ( (nr_blocks = (int64_t)strtoll(optarg,&strtol_ptr,10)) < 0) {
 					printf("Invalid value used for number of blocks\n");
 					exit(EXIT_FAILURE);
 				}
@@ -530,12 +635,23 @@ int main(int argc,char *argv[])
 					exit(EXIT_FAILURE);
 				}
 				break;
+			case 'g':
+				if ( (blocks_per_group = (int32_t)strtol(optarg,&strtol_ptr,10)) < 0) {
+					printf("Invalid value used for blocks per group\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'l':
+				/*Lazy inode table init.*/
+				lazy_itable = 1;
+				break;
 			default:
 				printf("Ignoring unknown option %s and continuing...\n",optarg);
 				break;
 		}
 	}
-	if (format_psfs(argv[1],block_size,nr_inodes,nr_blocks,extent_length) < 0) {
+	if (format_psfs(argv[1],block_size,nr_inodes,nr_blocks,extent_length,
+				blocks_per_group,lazy_itable) < 0) {
 		printf("Error in formatting device %s\n",argv[1]);
 		exit(EXIT_FAILURE);
 	}
@@ -0,0 +1,499 @@
+/*
+ * psfs-fsck: offline consistency check of the block and inode bitmaps.
+ *
+ * The device or image is mmaped. The inode table is split in chunks which
+ * worker threads pick up one at a time. Every inode in use marks its
+ * extents, and the blocks holding its indirect extents, in an expected
+ * block bitmap and itself in an expected inode bitmap. Blocks claimed
+ * twice and extents running off the volume are reported on the way. The
+ * expected bitmaps are then compared with the on-disk ones 64 bits at a
+ * time and with -y the on-disk ones are overwritten.
+ *
+ * An inode is in use when its slot has a type and carries its own inode
+ * number, which is what psfs_create leaves behind. In the part of a table
+ * not zeroed yet (PSFS_SUPER_LAZY_ITABLE) such a slot may also be a
+ * leftover from before the format. If its bit is clear it can't be told
+ * either way: it's reported and left alone, and the block bitmap then
+ * only gets missing bits set, never any cleared.
+ *
+ * Exit status as e2fsck: 0 clean, 1 errors fixed, 4 errors left, 8 failed.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <errno.h>
+#include <linux/fs.h> /*This is for BLKGETSIZE64*/
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <stdarg.h>
+#include <pthread.h>
+/*
+ * Must be included after linux/fs.h to avoid redeclaration
+ * error for types.
+ * */
+#ifndef __USER__
+#define __USER__
+#include "psfs.h"
+#endif
+
+#define OPTSTRING	"yj:"
+#define FSCK_CHUNK_BLOCKS	1024	/*Inode table blocks per work item*/
+#define FSCK_MAX_THREADS	64
+#define FSCK_MAX_REPORTS	20	/*Per kind of error, the rest is counted*/
+
+#define FSCK_OK			0
+#define FSCK_FIXED		1
+#define FSCK_UNCORRECTED	4
+#define FSCK_ERROR		8
+
+extern const char *__progname;
+
+/*
+ * Everything the workers share. The expected bitmaps are only ever set,
+ * with atomic or, the counters only added to.
+ */
+struct fsck {
+	unsigned char *disk;		/*The whole volume, mmaped*/
+	u_int32_t block_size;
+	u_int64_t nr_blocks;
+	u_int64_t nr_inodes;
+	u_int64_t nr_meta_blocks;	/*psfs_nr_boot_blocks*/
+	u_int64_t inode_table_block;
+	u_int64_t inode_table_blocks;
+	u_int64_t inode_bmp_block;
+	u_int64_t data_bmp_block;
+	u_int32_t inodes_per_block;
+	u_int64_t lazy_from;		/*First table block not zeroed yet*/
+
+	u_int64_t *block_bmap;		/*Expected bitmaps, bit n in word n/64*/
+	u_int64_t *inode_bmap;
+
+	u_int64_t next_chunk;
+	u_int64_t inodes_used;
+	u_int64_t blocks_used;
+	u_int64_t bad_extents;
+	u_int64_t dup_blocks;
+	u_int64_t unsure_inodes;	/*Not zeroed yet and bit clear*/
+	pthread_mutex_t report_lock;
+};
+
+/*
+ * Print the first few of each kind of error, count the rest.
+ */
+static void report(struct fsck *fs,u_int64_t nr,const char *fmt,...)
+	__attribute__((format(printf,3,4)));
+static void report(struct fsck *fs,u_int64_t nr,const char *fmt,...)
+{
+	va_list ap;
+	if (nr >= FSCK_MAX_REPORTS)
+		return;
+	va_start(ap,fmt);
+	pthread_mutex_lock(&fs->report_lock);
+	vprintf(fmt,ap);
+	pthread_mutex_unlock(&fs->report_lock);
+	va_end(ap);
+}
+
+static unsigned char *fsck_block(struct fsck *fs,u_int64_t block)
+{
+	return fs->disk + block*fs->block_size;
+}
+
+/*
+ * Set bits [start,start+len) in an expected bitmap.
+ * Returns how many of them were set already.
+ */
+static u_int64_t mark_range(u_int64_t *bmap,u_int64_t start,u_int64_t len)
+{
+	u_int64_t dups = 0;
+	while (len) {
+		u_int64_t bit = start & 63;
+		u_int64_t n = (64 - bit) < len ? (64 - bit) : len;
+		u_int64_t mask = (n == 64) ? ~0ULL : (((1ULL << n) - 1) << bit);
+		u_int64_t old = __sync_fetch_and_or(&bmap[start >> 6],mask);
+		dups += __builtin_popcountll(old & mask);
+		start += n;
+		len -= n;
+	}
+	return dups;
+}
+
+/*
+ * Account blocks [start,start+len) to inode ino.
+ * Returns 0 if they are all fine, -1 if the extent is bad or any block of
+ * it was already taken.
+ */
+static int mark_blocks(struct fsck *fs,u_int64_t ino,u_int64_t start,
+			u_int64_t len,const char *what)
+{
+	u_int64_t dups;
+	if (start < fs->nr_meta_blocks || start >= fs->nr_blocks ||
+		len > fs->nr_blocks - start) {
+		report(fs,__sync_fetch_and_add(&fs->bad_extents,1),
+			"inode %llu: %s [%llu,+%llu) outside the data area\n",
+			(unsigned long long)ino,what,(unsigned long long)start,
+			(unsigned long long)len);
+		return -1;
+	}
+	dups = mark_range(fs->block_bmap,start,len);
+	__sync_fetch_and_add(&fs->blocks_used,len - dups);
+	if (dups) {
+		report(fs,__sync_fetch_and_add(&fs->dup_blocks,dups),
+			"inode %llu: %s [%llu,+%llu) has %llu blocks claimed"
+			" twice\n",(unsigned long long)ino,what,
+			(unsigned long long)start,(unsigned long long)len,
+			(unsigned long long)dups);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Walk an indirect block the way psfs_emap_add_indirect does: at level 0
+ * it holds extents, above that block addresses of the next level down.
+ * Both lists end at the first empty slot.
+ * Returns 1 once the end of the file's extents is seen.
+ */
+static int check_indirect(struct fsck *fs,u_int64_t ino,u_int32_t block,
+				int level)
+{
+	unsigned char *data;
+	u_int32_t i;
+	int ret = 0;
+
+	/*Don't follow a block somebody else has, it may be a loop.*/
+	if (mark_blocks(fs,ino,block,1,"indirect block") < 0)
+		return 1;
+	data = fsck_block(fs,block);
+	if (!level) {
+		struct psfs_extent *extent = (struct psfs_extent *)data;
+		u_int32_t n = fs->block_size/sizeof(struct psfs_extent);
+		for (i = 0;i < n;i++) {
+			u_int32_t len = be32toh(extent[i].length);
+			if (!len)
+				return 1;
+			mark_blocks(fs,ino,be32toh(extent[i].block_no),len,
+					"extent");
+		}
+		return 0;
+	}
+	for (i = 0;i < fs->block_size/sizeof(u_int32_t) && !ret;i++) {
+		u_int32_t addr;
+		memcpy(&addr,data + i*sizeof(addr),sizeof(addr));
+		if (!addr)
+			return 1;
+		ret = check_indirect(fs,ino,be32toh(addr),level - 1);
+	}
+	return ret;
+}
+
+static int inode_bit(const unsigned char *bmap,u_int64_t ino)
+{
+	return (bmap[ino >> 3] >> (ino & 7)) & 1;
+}
+
+static void check_inode(struct fsck *fs,const struct psfs_inode *raw,
+			u_int64_t ino,int lazy)
+{
+	u_int32_t roots[3];
+	int i;
+
+	if (!raw->type || be32toh(raw->inode_nr) != ino)
+		return;
+	/*Maybe a leftover in a table that isn't zeroed yet.*/
+	if (lazy && !inode_bit(fsck_block(fs,fs->inode_bmp_block),ino)) {
+		report(fs,__sync_fetch_and_add(&fs->unsure_inodes,1),
+			"inode %llu: looks in use but its bit is clear and the"
+			" table isn't zeroed yet, left alone\n",
+			(unsigned long long)ino);
+		return;
+	}
+	mark_range(fs->inode_bmap,ino,1);
+	__sync_fetch_and_add(&fs->inodes_used,1);
+
+	for (i = 0;i < PSFS_NR_DIRECT_EXTENTS;i++) {
+		u_int32_t len = be32toh(raw->psfs_extent[i].length);
+		if (!len)
+			return;
+		mark_blocks(fs,ino,be32toh(raw->psfs_extent[i].block_no),len,
+				"extent");
+	}
+	roots[0] = be32toh(raw->indirect_extent);
+	roots[1] = be32toh(raw->double_indirect_extent);
+	roots[2] = be32toh(raw->triple_indirect_extent);
+	for (i = 0;i < 3;i++) {
+		if (!roots[i] || check_indirect(fs,ino,roots[i],i))
+			return;
+	}
+}
+
+static void *inode_worker(void *arg)
+{
+	struct fsck *fs = arg;
+	for (;;) {
+		u_int64_t chunk = __sync_fetch_and_add(&fs->next_chunk,1);
+		u_int64_t b = chunk*FSCK_CHUNK_BLOCKS;
+		u_int64_t end = b + FSCK_CHUNK_BLOCKS;
+
+		if (b >= fs->inode_table_blocks)
+			break;
+		if (end > fs->inode_table_blocks)
+			end = fs->inode_table_blocks;
+		madvise(fsck_block(fs,fs->inode_table_block + b),
+			(end - b)*fs->block_size,MADV_WILLNEED);
+		for (;b < end;b++) {
+			const struct psfs_inode *raw = (const struct psfs_inode *)
+				fsck_block(fs,fs->inode_table_block + b);
+			u_int64_t ino = b*fs->inodes_per_block;
+			u_int32_t i;
+			for (i = 0;i < fs->inodes_per_block &&
+					ino + i < fs->nr_inodes;i++)
+				check_inode(fs,raw + i,ino + i,b >= fs->lazy_from);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Compare an on-disk bitmap of nbits bits with the expected one, a word
+ * at a time. With repair the on-disk words which differ are replaced.
+ * With keep bits set on disk are never cleared.
+ * @missing: bits in use but clear on disk.
+ * @leaked: bits set on disk but not in use.
+ */
+static void diff_bitmap(unsigned char *disk,u_int64_t *expected,
+			u_int64_t nbits,int repair,int keep,u_int64_t *missing,
+			u_int64_t *leaked,u_int64_t *first_bad)
+{
+	u_int64_t nwords = (nbits + 63) >> 6;
+	u_int64_t w;
+
+	*missing = *leaked = 0;
+	*first_bad = nbits;
+	for (w = 0;w < nwords;w++) {
+		u_int64_t left = nbits - (w << 6);
+		u_int64_t valid = left >= 64 ? ~0ULL : ((1ULL << left) - 1);
+		u_int64_t nbytes = left >= 64 ? 8 : (left + 7) >> 3;
+		u_int64_t on_disk = 0,diff;
+
+		memcpy(&on_disk,disk + (w << 3),nbytes);
+		on_disk = le64toh(on_disk);
+		diff = (on_disk ^ expected[w]) & valid;
+		if (!diff)
+			continue;
+		if (*first_bad == nbits)
+			*first_bad = (w << 6) + __builtin_ctzll(diff);
+		*missing += __builtin_popcountll(diff & expected[w]);
+		*leaked += __builtin_popcountll(diff & on_disk);
+		if (repair) {
+			u_int64_t want = keep ? expected[w] | on_disk : expected[w];
+			on_disk = htole64((on_disk & ~valid) | (want & valid));
+			memcpy(disk + (w << 3),&on_disk,nbytes);
+		}
+	}
+}
+
+static int check_bitmap(const char *name,unsigned char *disk,
+			u_int64_t *expected,u_int64_t nbits,int repair,int keep)
+{
+	u_int64_t missing,leaked,first_bad;
+
+	diff_bitmap(disk,expected,nbits,repair,keep,&missing,&leaked,
+			&first_bad);
+	if (!missing && !leaked)
+		return FSCK_OK;
+	printf("%s bitmap: %llu in use but marked free, %llu marked in use"
+		" but free, first at %llu%s\n",name,
+		(unsigned long long)missing,(unsigned long long)leaked,
+		(unsigned long long)first_bad,!repair ? "" :
+		keep && leaked ? ", only missing bits set" : ", fixed");
+	if (!repair)
+		return FSCK_UNCORRECTED;
+	if (keep && leaked)
+		return missing ? FSCK_FIXED | FSCK_UNCORRECTED : FSCK_UNCORRECTED;
+	return FSCK_FIXED;
+}
+
+/*
+ * Read the super block and work out the layout as psfs_init_geometry does.
+ */
+static int load_super(struct fsck *fs,const struct psfs_super_block *ps,
+			u_int64_t dev_size)
+{
+	u_int64_t inode_bmap_blocks;
+	u_int64_t bits_per_block;
+
+	if (be32toh(ps->psfs_magic) != PSFS_MAGIC) {
+		printf("Bad magic %x, not a psfs volume\n",be32toh(ps->psfs_magic));
+		return -1;
+	}
+	fs->block_size = be32toh(ps->psfs_block_size);
+	if (fs->block_size < PSFS_DEFAULT_BLKSIZE ||
+		(fs->block_size & (fs->block_size - 1))) {
+		printf("Bad block size %u\n",fs->block_size);
+		return -1;
+	}
+	bits_per_block = (u_int64_t)fs->block_size*8;
+	fs->nr_blocks = be64toh(ps->psfs_nr_blocks);
+	fs->nr_inodes = be64toh(ps->psfs_nr_inodes);
+	fs->nr_meta_blocks = be32toh(ps->psfs_nr_boot_blocks);
+	fs->inodes_per_block = fs->block_size/sizeof(struct psfs_inode);
+	fs->inode_table_block = PSFS_SUPERBLOCK + 1;
+	fs->inode_table_blocks = (fs->nr_inodes + fs->inodes_per_block - 1)/
+					fs->inodes_per_block;
+	fs->inode_bmp_block = fs->inode_table_block + fs->inode_table_blocks;
+	inode_bmap_blocks = (fs->nr_inodes + bits_per_block - 1)/bits_per_block;
+	fs->data_bmp_block = fs->inode_bmp_block + inode_bmap_blocks;
+	fs->lazy_from = fs->inode_table_blocks;
+	if (be32toh(ps->psfs_super_flags) & PSFS_SUPER_LAZY_ITABLE)
+		fs->lazy_from = be64toh(ps->psfs_itable_zeroed);
+
+	if (fs->nr_blocks*fs->block_size > dev_size) {
+		printf("Volume has %llu blocks but the device only %llu\n",
+			(unsigned long long)fs->nr_blocks,
+			(unsigned long long)(dev_size/fs->block_size));
+		return -1;
+	}
+	if (fs->data_bmp_block + (fs->nr_blocks + bits_per_block - 1)/bits_per_block >
+		fs->nr_meta_blocks || fs->nr_meta_blocks > fs->nr_blocks) {
+		printf("Metadata layout doesn't fit in %llu boot blocks\n",
+			(unsigned long long)fs->nr_meta_blocks);
+		return -1;
+	}
+	return 0;
+}
+
+int fsck_psfs(const char *device,int repair,int nr_threads)
+{
+	struct fsck fs;
+	struct psfs_super_block super;
+	pthread_t threads[FSCK_MAX_THREADS];
+	struct stat st;
+	u_int64_t dev_size;
+	int dev_fd,i,ret = FSCK_OK,ret2;
+
+	memset(&fs,0,sizeof(fs));
+	pthread_mutex_init(&fs.report_lock,NULL);
+	dev_fd = open(device,repair ? O_RDWR : O_RDONLY);
+	if (dev_fd < 0 || fstat(dev_fd,&st) < 0) {
+		perror("FATAL Error opening device");
+		return FSCK_ERROR;
+	}
+	if (S_ISREG(st.st_mode))
+		dev_size = st.st_size;
+	else if (ioctl(dev_fd,BLKGETSIZE64,&dev_size) < 0) {
+		perror("FATAL Error getting device size");
+		return FSCK_ERROR;
+	}
+	if (pread(dev_fd,&super,sizeof(super),0) != sizeof(super)) {
+		perror("FATAL Error reading super block");
+		return FSCK_ERROR;
+	}
+	if (load_super(&fs,&super,dev_size) < 0)
+		return FSCK_ERROR;
+
+	fs.disk = mmap(NULL,fs.nr_blocks*fs.block_size,
+			repair ? PROT_READ|PROT_WRITE : PROT_READ,MAP_SHARED,
+			dev_fd,0);
+	if (fs.disk == MAP_FAILED) {
+		perror("FATAL Error mapping device");
+		return FSCK_ERROR;
+	}
+	fs.block_bmap = calloc((fs.nr_blocks + 63) >> 6,sizeof(u_int64_t));
+	fs.inode_bmap = calloc((fs.nr_inodes + 63) >> 6,sizeof(u_int64_t));
+	if (!fs.block_bmap || !fs.inode_bmap) {
+		printf("Unable to allocate memory for the bitmaps!\n");
+		return FSCK_ERROR;
+	}
+	/*The metadata is in use by definition.*/
+	mark_range(fs.block_bmap,0,fs.nr_meta_blocks);
+	fs.blocks_used = fs.nr_meta_blocks;
+
+	madvise(fsck_block(&fs,fs.inode_table_block),
+		fs.inode_table_blocks*fs.block_size,MADV_SEQUENTIAL);
+	for (i = 0;i < nr_threads;i++) {
+		if (pthread_create(&threads[i],NULL,inode_worker,&fs)) {
+			printf("Unable to start checker threads\n");
+			nr_threads = i;
+			break;
+		}
+	}
+	/*Nothing started, do it ourselves.*/
+	if (!nr_threads)
+		inode_worker(&fs);
+	for (i = 0;i < nr_threads;i++)
+		pthread_join(threads[i],NULL);
+
+	printf("%llu inodes in use, %llu blocks in use\n",
+		(unsigned long long)fs.inodes_used,
+		(unsigned long long)fs.blocks_used);
+	if (fs.bad_extents || fs.dup_blocks) {
+		printf("%llu extents outside the data area, %llu blocks claimed"
+			" twice, left alone\n",(unsigned long long)fs.bad_extents,
+			(unsigned long long)fs.dup_blocks);
+		ret = FSCK_UNCORRECTED;
+	}
+	/*
+	 * Their blocks aren't in the expected bitmap, so don't let them go
+	 * on the strength of a slot that may or may not be an inode.
+	 */
+	if (fs.unsure_inodes) {
+		printf("%llu inodes of the table not zeroed yet look in use but"
+			" are marked free, left alone\n",
+			(unsigned long long)fs.unsure_inodes);
+		ret = FSCK_UNCORRECTED;
+	}
+	ret2 = check_bitmap("Inode",fsck_block(&fs,fs.inode_bmp_block),
+			fs.inode_bmap,fs.nr_inodes,repair,0);
+	ret |= ret2;
+	ret2 = check_bitmap("Block",fsck_block(&fs,fs.data_bmp_block),
+			fs.block_bmap,fs.nr_blocks,repair,fs.unsure_inodes != 0);
+	ret |= ret2;
+	if (repair && (ret & FSCK_FIXED) &&
+		msync(fs.disk,fs.nr_blocks*fs.block_size,MS_SYNC) < 0) {
+		perror("FATAL Error writing back bitmaps");
+		ret |= FSCK_ERROR;
+	}
+	munmap(fs.disk,fs.nr_blocks*fs.block_size);
+	free(fs.block_bmap);
+	free(fs.inode_bmap);
+	close(dev_fd);
+	return ret;
+}
+
+int main(int argc,char *argv[])
+{
+	int repair = 0,nr_threads;
+	extern int optind;
+	char *strtol_ptr;
+	int c;
+
+	nr_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	while ( (c = getopt(argc,argv,OPTSTRING)) != -1) {
+		switch (c) {
+			case 'y':
+				repair = 1;
+				break;
+			case 'j':
+				nr_threads = (int)strtol(optarg,&strtol_ptr,10);
+				break;
+			default:
+				optind = argc;
+				break;
+		}
+	}
+	if (optind != argc - 1) {
+		printf("Usage %s [-y] [-j threads] <device_file|image_file>\n",__progname);
+		exit(FSCK_ERROR);
+	}
+	if (nr_threads < 1)
+		nr_threads = 1;
+	if (nr_threads > FSCK_MAX_THREADS)
+		nr_threads = FSCK_MAX_THREADS;
+	return fsck_psfs(argv[optind],repair,nr_threads);
+}
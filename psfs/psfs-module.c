@@ -1,5 +1,7 @@
 #define MOD_AUTHOR "Shwetabh and Pranay <pranay_shwetabh@lulu.com>"
 #include "psfs.h"
+#define CREATE_TRACE_POINTS
+#include<trace/events/psfs.h>
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,99)
 extern int psfs_get_sb(struct file_system_type *fs_type, int flags,
                 const char *dev_name, void *data, struct vfsmount *mnt);
@@ -8,6 +10,10 @@ extern struct dentry *psfs_get_sb(struct file_system_type *fs_type, int flags,
                 const char *dev_name, void *data);
 #endif /*LINUX_VERSION_CODE*/
 
+unsigned int psfs_debug __read_mostly;
+module_param_named(debug,psfs_debug,uint,0644);
+MODULE_PARM_DESC(debug,"Debug output mask, see PSFS_DEBUG_* in psfs.h");
+
 extern int init_inodecache(void);
 extern void destroy_inode_cache(void);
 
@@ -27,13 +33,28 @@ static int  __init init_psfs(void)
 {
         int err = 0;
         err = init_inodecache();
-        err += register_filesystem(&psfs_type);
-	printk(KERN_INFO "file system type is at %p\n",&psfs_type);
+	if (err)
+		return err;
+	err = psfs_sysfs_init();
+	if (err) {
+		destroy_inode_cache();
+		return err;
+	}
+        err = register_filesystem(&psfs_type);
+	if (err) {
+		psfs_sysfs_exit();
+		destroy_inode_cache();
+		return err;
+	}
+	psfs_dcache_init();
+	PSFS_DBG(PSFS_DEBUG_MOUNT,"psfs: file system type is at %p\n",&psfs_type);
         return err;
 }
 static void __exit exit_psfs(void)
 {
         unregister_filesystem(&psfs_type);
+	psfs_dcache_exit();
+	psfs_sysfs_exit();
         destroy_inode_cache();
         return;
 }
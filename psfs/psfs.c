@@ -55,18 +55,36 @@ static void psfs_inode_to_cpu(struct psfs_inode *inode)
         inode->flags = be16_to_cpu(inode->flags);
         inode->owner = be16_to_cpu(inode->owner);
 }
-int main()
+/*
+ * Dump the root inode and its first directory entry of a device or an
+ * image file.
+ */
+int main(int argc,char *argv[])
 {
+	struct psfs_super_block super;
+	u_int32_t block_size;
+
 	printf("sizeof psfs_inode=%d bytes\n",sizeof(struct psfs_inode));
 	printf("sizeof psfs_super_block=%d bytes\n",sizeof(struct psfs_super_block));
 	printf("sizeof psfs_extent is %d bytes\n",sizeof(struct psfs_extent));
 
-	int fd = open("/dev/loop0",O_RDONLY);
+	if (argc < 2) {
+		printf("Usage %s <device_file|image_file>\n",argv[0]);
+		return EXIT_FAILURE;
+	}
+	int fd = open(argv[1],O_RDONLY);
 	if(fd < 0) {
 		perror("Error opening file");
 		return EXIT_FAILURE;
 	}
-	if(llseek(fd,4096,SEEK_SET) < 0) {
+	if (read(fd,&super,sizeof(super)) != sizeof(super)) {
+		printf("couldn't read the super block\n");
+		return EXIT_FAILURE;
+	}
+	block_size = be32_to_cpu(super.psfs_block_size);
+	printf(PSFS_DBG_VAR("%u\n",block_size));
+	/*The root inode is the first one, in the block after the super block.*/
+	if(llseek(fd,block_size,SEEK_SET) < 0) {
 		perror("Error seeking file:");
 		return EXIT_FAILURE;
 	}
@@ -81,7 +99,7 @@ int main()
 	printf(PSFS_DBG_VAR("%lu\n",inode.flags));
 	printf(PSFS_DBG_VAR("%lx\n",inode.psfs_extent[0].block_no));
 	struct psfs_dir_entry dirent;
-	if (llseek(fd,(inode.psfs_extent[0].block_no)*4096,SEEK_SET)<0)
+	if (llseek(fd,(u_int64_t)(inode.psfs_extent[0].block_no)*block_size,SEEK_SET)<0)
 	{
 		printf("couldn't seek\n");
 		return EXIT_FAILURE;
@@ -3,6 +3,12 @@
 
 #ifndef __USER__
 #include "../include/common.h"
+#include <linux/rbtree.h>
+#include <linux/percpu_counter.h>
+#include <linux/percpu.h>
+#include <linux/completion.h>
+#include <linux/mutex.h>
+#include <linux/reciprocal_div.h>
 #define PACKED_STRUCT	__attribute__((packed))
 #else
 
@@ -23,10 +29,31 @@
 #define PSFS_DEFAULT_EXTENT_LEN (1<<2)  /*4 blocks*/
 #define KERNEL_SECTOR_SIZE      (1<<9) /*512*/
 #define PSFS_DBG_VAR(fmt,X)      #X fmt,X
-#define PSFS_DBG_MSG(msg) 	printk(KERN_INFO msg \
+#ifndef __USER__
+/*
+ * Debug output. Nothing is printed unless the matching bit is set in the
+ * module's debug parameter (also writable in /sys/module/psfs_fs/
+ * parameters/debug), and when it's clear all it costs is one test of a
+ * read mostly variable. Static keys would get rid of even that but this
+ * kernel doesn't have them.
+ */
+#define PSFS_DEBUG_MISC		(1<<0)
+#define PSFS_DEBUG_MOUNT	(1<<1)
+#define PSFS_DEBUG_OPEN		(1<<2)
+#define PSFS_DEBUG_LOOKUP	(1<<3)
+#define PSFS_DEBUG_READDIR	(1<<4)
+#define PSFS_DEBUG_INODE	(1<<5)
+#define PSFS_DEBUG_ALLOC	(1<<6)
+extern unsigned int psfs_debug;
+#define PSFS_DBG(mask,...)	do {\
+				if (unlikely(psfs_debug & (mask)))\
+					printk(KERN_DEBUG __VA_ARGS__);\
+				} while (0)
+#define PSFS_DBG_MSG(msg) 	PSFS_DBG(PSFS_DEBUG_MISC,msg \
 				"In Function %s at line %d\n"\
 				,__FUNCTION__,__LINE__)
 #define PSFS_DBG_NONE()		PSFS_DBG_MSG("")
+#endif /*__USER__*/
 #define PSFS_DFLT_BLOCKSIZE 4096
 #define PSFS_SUPERBLOCK     0
 #define PSFS_ROOT_INODE     0
@@ -75,7 +102,46 @@ struct psfs_super_block {
 	__u32		psfs_super_flags;
 	__u32		psfs_magic;
 	__u32		psfs_block_size;
-}PACKED_STRUCT; /*40 bytes*/
+	/*
+	 * Allocation groups, only valid with PSFS_SUPER_AG set. Older
+	 * images have these zeroed.
+	 */
+	__u64		psfs_group_desc_block;/*First block of descriptor table*/
+	__u32		psfs_nr_groups;
+	__u32		psfs_blocks_per_group;
+	__u32		psfs_inodes_per_group;
+	__u32		psfs_reserved;
+	/*
+	 * Lazy inode table init, only valid with PSFS_SUPER_LAZY_ITABLE set.
+	 * Inode table blocks below this one have been zeroed, the rest may
+	 * hold anything except in slots of allocated inodes.
+	 */
+	__u64		psfs_itable_zeroed;
+}PACKED_STRUCT; /*72 bytes*/
+
+#define PSFS_SUPER_AG		(1<<0)	/*Volume is split in allocation groups*/
+#define PSFS_SUPER_LAZY_ITABLE	(1<<1)	/*Inode table not fully zeroed yet*/
+
+/*
+ * Allocation groups.
+ *
+ * The inode and block bitmaps stay where they are (see the layout below),
+ * a group just owns a slice of each. Group g owns data blocks
+ * [g*blocks_per_group, (g+1)*blocks_per_group) and inodes
+ * [g*inodes_per_group, (g+1)*inodes_per_group). blocks_per_group is a
+ * multiple of the bits in a block so a group's block bitmap is made of
+ * whole blocks, inodes_per_group is a multiple of 8 so no two groups share
+ * a byte of the inode bitmap. The descriptor table follows the data bitmap
+ * and is accounted in psfs_nr_boot_blocks.
+ */
+struct psfs_group_desc {
+	__u64		gd_block_bitmap;/*First block of this group's data bitmap*/
+	__u64		gd_inode_bitmap;/*Block holding this group's first inode bit*/
+	__u32		gd_inode_bitmap_off;/*Byte offset of it in that block*/
+	__u32		gd_free_blocks;
+	__u32		gd_free_inodes;
+	__u32		gd_flags;
+}PACKED_STRUCT; /*32 bytes*/
 
 /*
  * Extent allocation is done twice the size of last extent allocated. The
@@ -135,24 +201,213 @@ struct psfs_dir_entry {
 }PACKED_STRUCT;
 #define PSFS_MIN_DIRENT_SIZE	(sizeof(struct psfs_dir_entry)-PSFS_FILENAME_LEN)
 
+/*
+ * Name hash for the directory cache, see struct psfs_dcache.
+ */
+extern __u32 psfs_name_hash(const unsigned char *name,int len);
+
+/*
+ * Bitmap helpers from lib.c, these are shared by the module and psfs-format.
+ */
+extern __u64 psfs_find_next_zero_bit(const unsigned char *bitmap,__u64 nbits,
+					__u64 offset);
+extern __u64 psfs_find_next_bit(const unsigned char *bitmap,__u64 nbits,
+					__u64 offset);
+extern __u64 psfs_find_zero_run(const unsigned char *bitmap,__u64 nbits,
+					__u64 offset,__u64 nr,__u64 *run_len);
+extern void psfs_bmap_set_range(char *bitmap,__u64 start,__u64 len);
+extern void psfs_bmap_clear_range(char *bitmap,__u64 start,__u64 len);
+extern int32_t alloc_bmap(char *bitmap,int32_t bmap_len,int32_t *hint);
+extern int32_t free_bmap(char *bitmap,int32_t bmap_len,int32_t bit_no,
+				int32_t *hint);
+extern int alloc_psfs_extent(struct psfs_extent *extent,int64_t nr_blocks,
+				char *bitmap,int32_t bmap_len,int32_t *hint);
+
 /*
  * In memory super block of psfs
  *
  */
 #ifndef __USER__
+/*
+ * One extent of a file with the logical block it starts at. The extent map
+ * of an inode is an array of these sorted by lblk, see psfs_map_block.
+ */
+struct psfs_extent_map {
+	__u64 lblk;
+	__u32 pblk;
+	__u32 len;
+};
+
 struct psfs_inode_info {
 	struct inode vfs_inode;
 	struct psfs_inode psfs_inode;
 	struct list_head bh_list;
         __u16 flags;
+	/*
+	 * Extent map cache, built on first use from the direct and indirect
+	 * extents. Whoever changes the extents must hold emap_sem for write
+	 * and drop the map with psfs_drop_extent_map.
+	 */
+	struct rw_semaphore emap_sem;
+	struct psfs_extent_map *emap;
+	__u32 emap_nr;
+	/*
+	 * One past the last block reserved by a write, that's as far as
+	 * psfs_writepages allocates. Set under i_mutex.
+	 */
+	sector_t da_end;
+	/*
+	 * Names of the directory, or for a large one an index of them, see
+	 * dir.c. Built and used under the directory's i_mutex.
+	 */
+	struct psfs_dcache *dcache;
+};
+
+/*
+ * In memory copy of the entries of a directory, an open addressing hash
+ * table keyed by psfs_name_hash. Slots with name_len 0 are free. Names
+ * live in one blob behind the slots.
+ *
+ * For a large directory (index set) the names aren't kept, a slot only
+ * says which directory block holds a name of that hash and length.
+ */
+struct psfs_dcache_ent {
+	__u32 hash;
+	__u32 ino;
+	union {
+		__u32 name_off;
+		__u32 lblk;	/*index*/
+	};
+	__u16 flags;
+	__u8 name_len;
+};
+
+struct psfs_dcache {
+	struct list_head lru;	/*On psfs_dcache_list*/
+	struct psfs_inode_info *psi;
+	int referenced;		/*Hit since the shrinker last looked*/
+	int index;		/*Slots point at blocks, no names*/
+	__u32 mask;		/*Number of slots - 1*/
+	struct psfs_dcache_ent *slots;
+	char *names;
 };
 	
 struct psfs_sb_info {
-        struct psfs_super_block *s_ps;
-	void *data_block_bmap;
-	void *inode_block_bmap;
+        struct psfs_super_block *s_ps;	/*cpu order copy of s_bh's*/
+	/*
+	 * Bitmap blocks, read on first use and pinned until unmount. See
+	 * psfs_bmap_bh. Slots are filled under bmap_lock.
+	 */
+	struct buffer_head **data_block_bmap;
+	struct buffer_head **inode_block_bmap;
+	__u64 nr_data_bmap_blocks;
+	__u64 nr_inode_bmap_blocks;
+	spinlock_t bmap_lock;
 	void *inode_table;
         struct buffer_head *s_bh;
+	/*
+	 * Geometry of this volume, set up by psfs_init_geometry at mount.
+	 */
+	__u64 inode_table_block;
+	__u64 inode_bmp_block;
+	__u64 data_bmp_block;
+	__u32 bits_per_block_shift;	/*log2 of bits in a bitmap block*/
+	__u64 bits_per_block_mask;
+	__u32 inodes_per_block;
+	__u32 inodes_per_block_rcp;	/*reciprocal_value(inodes_per_block)*/
+	/*
+	 * Allocation groups, see group.c. A volume formatted without groups
+	 * gets a single group spanning all of it.
+	 */
+	struct psfs_group_info *groups;
+	__u32 nr_groups;
+	__u64 blocks_per_group;
+	__u64 inodes_per_group;
+	/*
+	 * Blocks promised to dirty page cache data that has no blocks yet
+	 * (delayed allocation), see psfs_reserve_blocks.
+	 */
+	struct percpu_counter s_dirty_blocks;
+	/*
+	 * Free blocks and inodes, counted from the bitmaps at mount and kept
+	 * up to date by the allocators so statfs doesn't have to look at the
+	 * groups.
+	 */
+	struct percpu_counter s_free_blocks;
+	struct percpu_counter s_free_inodes;
+	/*
+	 * Zeroes the inode table of a volume formatted with lazy init, see
+	 * psfs_itable_thread. s_itable_lock orders it against
+	 * psfs_write_inode on blocks above s_ps->psfs_itable_zeroed, both
+	 * clear the free slots of such a block, see psfs_itable_zero_free.
+	 */
+	struct task_struct *s_itable_task;
+	struct mutex s_itable_lock;
+	/*
+	 * Statistics, see sysfs.c.
+	 */
+	struct psfs_stats __percpu *s_stats;
+	struct kobject s_kobj;
+	struct completion s_kobj_unregister;
+};
+
+enum {
+	PSFS_STAT_INODE_READS,		/*Inodes read from the inode table*/
+	PSFS_STAT_ICACHE_HITS,		/*psfs_iget found the inode cached*/
+	PSFS_STAT_DCACHE_HITS,		/*Lookups answered by a psfs_dcache*/
+	PSFS_STAT_DIRENTS_SCANNED,	/*Entries looked at in directory blocks*/
+	PSFS_STAT_ALLOC_GROUPS_SCANNED,	/*Groups tried by psfs_alloc_blocks*/
+	PSFS_STAT_EXTENTS_ALLOCED,
+	PSFS_STAT_BLOCKS_ALLOCED,
+	PSFS_STAT_PARTIAL_ALLOCS,	/*Got a shorter extent than asked for*/
+	PSFS_STAT_EXTENTS_FREED,
+	PSFS_STAT_BLOCKS_FREED,
+	PSFS_STAT_SYNC_META_READS,	/*Metadata blocks read and waited on*/
+	PSFS_STAT_ASYNC_META_READS,	/*Metadata readahead submitted*/
+	PSFS_STAT_MAX
+};
+
+struct psfs_stats {
+	__u64 count[PSFS_STAT_MAX];
+};
+
+#define psfs_stat_add(psbi,stat,n)	this_cpu_add((psbi)->s_stats->count[stat],n)
+#define psfs_stat_inc(psbi,stat)	psfs_stat_add(psbi,stat,1)
+
+/*
+ * In memory state of an allocation group. Everything in here, including
+ * the group's slices of the on-disk bitmaps, is protected by lock.
+ */
+struct psfs_group_info {
+	spinlock_t lock;
+	__u32 group_no;
+	__u64 block_bitmap;	/*As in psfs_group_desc, cpu order*/
+	__u64 inode_bitmap;
+	__u32 inode_bitmap_off;
+	__u64 first_block;	/*First data block of the group*/
+	__u64 nr_blocks;	/*Blocks in this group, last one may be short*/
+	__u64 first_ino;
+	__u32 nr_inodes;
+	__u64 free_blocks;
+	__u32 free_inodes;
+	int32_t inode_bmap_hint; /*Next likely free bit in the inode bitmap*/
+	int32_t data_bmap_hint;  /*Next likely free bit in the data bitmap*/
+	/*
+	 * Free extent index, see extent.c. Both trees hold the same
+	 * psfs_free_extent nodes.
+	 */
+	struct rb_root free_by_start;
+	struct rb_root free_by_len;
+};
+
+/*
+ * A run of free data blocks, linked in both trees of psfs_group_info.
+ */
+struct psfs_free_extent {
+	struct rb_node by_start;
+	struct rb_node by_len;
+	__u64 start;
+	__u64 len;
 };
 static inline struct psfs_inode_info *PSFS_I(struct inode *inode)
 {
@@ -162,15 +417,80 @@ static inline struct psfs_sb_info *PSFS_SB(struct super_block *sb)
 {
         return sb->s_fs_info;
 }
+
+/*
+ * Inode table block (relative to inode_table_block) and slot of ino.
+ * reciprocal_divide is approximate, for large inode numbers the quotient
+ * comes out one too high, so it's corrected against the exact product.
+ */
+static inline __u32 psfs_ino_to_block(struct psfs_sb_info *psbi,__u32 ino,
+					__u32 *offset)
+{
+	__u32 block = reciprocal_divide(ino,psbi->inodes_per_block_rcp);
+
+	while ((__u64)block*psbi->inodes_per_block > ino)
+		block--;
+	while (ino - block*psbi->inodes_per_block >= psbi->inodes_per_block)
+		block++;
+	if (offset)
+		*offset = ino - block*psbi->inodes_per_block;
+	return block;
+}
 struct bh_list {
 	struct list_head list;
 	struct buffer_head *bh;
 };
-extern int32_t alloc_bmap(char *bitmap,int32_t bmap_len);
-extern int32_t free_bmap(char *bitmap,int32_t bmap_len,int32_t bit_no);
-extern __u64 get_inode_bmp_block(struct psfs_sb_info *psbi,__u32 blocksize);
-extern __u64 get_data_bmp_block(struct psfs_sb_info *psbi,__u32 blocksize);
-extern __u64 psfs_inode_bmp_block;
-extern __u64 psfs_data_bmp_block;
+extern void psfs_init_geometry(struct super_block *sb);
+extern void psfs_set_inode_ops(struct inode *inode);
+extern struct inode *psfs_iget(struct super_block *sb,unsigned long ino);
+extern int psfs_map_block(struct inode *inode,sector_t iblock,sector_t *phys,
+				unsigned long *max_blocks);
+extern void psfs_drop_extent_map(struct psfs_inode_info *psi);
+#define PSFS_INODE_BMAP		0
+#define PSFS_DATA_BMAP		1
+extern int psfs_init_bmap_cache(struct super_block *sb);
+extern void psfs_destroy_bmap_cache(struct psfs_sb_info *psbi);
+extern struct buffer_head *psfs_bmap_bh(struct super_block *sb,int which,
+					__u64 idx);
+extern struct buffer_head *psfs_meta_bread(struct super_block *sb,
+					sector_t block);
+extern void psfs_meta_breadahead(struct super_block *sb,sector_t block);
+extern int psfs_itable_zero_free(struct super_block *sb,__u64 b,
+				struct buffer_head *bh);
+extern int psfs_build_free_index(struct super_block *sb);
+extern void psfs_destroy_free_index(struct psfs_sb_info *psbi);
+extern int psfs_index_alloc(struct psfs_group_info *grp,__u64 nr_blocks,
+				struct psfs_extent *extent);
+extern int psfs_index_free(struct psfs_group_info *grp,__u64 start,__u64 len);
+struct writeback_control;
+extern int psfs_find_entry(struct inode *dir,const struct qstr *name,
+				__u32 *ino);
+extern int psfs_dcache_get(struct inode *dir);
+extern void psfs_dcache_drop(struct psfs_inode_info *psi);
+extern void psfs_dcache_init(void);
+extern void psfs_dcache_exit(void);
+extern int psfs_sysfs_register(struct super_block *sb);
+extern void psfs_sysfs_unregister(struct psfs_sb_info *psbi);
+extern int psfs_sysfs_init(void);
+extern void psfs_sysfs_exit(void);
+extern int psfs_write_inode(struct inode *inode,struct writeback_control *wbc);
+extern int psfs_alloc_blocks(struct super_block *sb,struct psfs_group_info *goal,
+				__u64 nr_blocks,struct psfs_extent *extent);
+extern int psfs_free_blocks(struct super_block *sb,__u64 start,__u64 len);
+extern __u64 psfs_count_free_blocks(struct psfs_sb_info *psbi);
+extern int psfs_reserve_blocks(struct super_block *sb,__u64 nr);
+extern void psfs_release_blocks(struct super_block *sb,__u64 nr);
+extern __u64 psfs_spare_blocks(struct super_block *sb);
+extern int psfs_load_groups(struct super_block *sb);
+extern void psfs_put_groups(struct super_block *sb);
+extern struct psfs_group_info *psfs_group_of_block(struct psfs_sb_info *psbi,
+							__u64 block);
+extern struct psfs_group_info *psfs_group_of_ino(struct psfs_sb_info *psbi,
+							__u64 ino);
+extern struct psfs_group_info *psfs_pick_group(struct super_block *sb,
+						struct inode *dir,int mode);
+extern int64_t psfs_count_free_inodes(struct super_block *sb);
+extern int64_t psfs_group_alloc_ino(struct super_block *sb,
+					struct psfs_group_info *grp);
 #endif /*__USER__*/
 #endif /*__PSFS_H__*/
@@ -1,6 +1,7 @@
 #define MODULE_OWNERSHIP
 #include "psfs.h"
 #include<linux/buffer_head.h>
+#include<linux/statfs.h>
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,99)
 int psfs_get_sb(struct file_system_type *fs_type, int flags,
@@ -13,12 +14,8 @@ extern void psfs_destroy_inode(struct inode *inode);
 extern struct inode *psfs_get_inode(struct super_block *sb);
 extern const struct inode_operations psfs_iops;
 extern const struct file_operations psfs_fops;
-extern struct psfs_inode_info *psfs_read_inode(struct super_block *sb, unsigned int ino,
-                               struct psfs_inode_info *psi);
 static void psfs_super_block_to_cpu(struct psfs_super_block *sb);
 static void psfs_super_block_to_be(struct psfs_super_block *sb);
-__u64 psfs_inode_bmp_block;
-__u64 psfs_data_bmp_block;
 /*
  * To convert from N bit to cpu use as MEMBER_TO_CPU(member,N).
  */
@@ -42,6 +39,11 @@ static void psfs_super_block_to_cpu(struct psfs_super_block *sb)
 	MEMBER_TO_CPU(sb->psfs_super_flags,32);
 	MEMBER_TO_CPU(sb->psfs_magic,32);
 	MEMBER_TO_CPU(sb->psfs_block_size,32);
+	MEMBER_TO_CPU(sb->psfs_group_desc_block,64);
+	MEMBER_TO_CPU(sb->psfs_nr_groups,32);
+	MEMBER_TO_CPU(sb->psfs_blocks_per_group,32);
+	MEMBER_TO_CPU(sb->psfs_inodes_per_group,32);
+	MEMBER_TO_CPU(sb->psfs_itable_zeroed,64);
 }
 static void psfs_super_block_to_be(struct psfs_super_block *sb)
 {
@@ -53,12 +55,231 @@ static void psfs_super_block_to_be(struct psfs_super_block *sb)
 	MEMBER_TO_BE(sb->psfs_super_flags,32);
 	MEMBER_TO_BE(sb->psfs_magic,32);
 	MEMBER_TO_BE(sb->psfs_block_size,32);
+	MEMBER_TO_BE(sb->psfs_group_desc_block,64);
+	MEMBER_TO_BE(sb->psfs_nr_groups,32);
+	MEMBER_TO_BE(sb->psfs_blocks_per_group,32);
+	MEMBER_TO_BE(sb->psfs_inodes_per_group,32);
+	MEMBER_TO_BE(sb->psfs_itable_zeroed,64);
 }
+
+/*
+ * Lazy inode table init.
+ *
+ * psfs-format -l leaves the inode table as it found it. Only slots of
+ * allocated inodes are ever read and psfs_create fills in the whole slot,
+ * so the volume is usable right away. psfs_itable_thread zeroes the
+ * table in the background, only clearing the free slots of blocks which
+ * already hold an allocated inode, and moves psfs_itable_zeroed up as it
+ * goes. Every free slot below psfs_itable_zeroed is zero.
+ */
+#define PSFS_ITABLE_BATCH	64	/*Blocks zeroed between two commits*/
+#define PSFS_ITABLE_DELAY	(HZ/10)	/*Pause between batches*/
+
+static __u64 psfs_itable_blocks(struct psfs_sb_info *psbi)
+{
+	return psbi->inode_bmp_block - psbi->inode_table_block;
+}
+
+/*
+ * Does inode table block b hold an allocated inode? Called with
+ * s_itable_lock held.
+ */
+static int psfs_itable_block_used(struct super_block *sb,__u64 b)
+{
+	struct psfs_sb_info *psbi = PSFS_SB(sb);
+	__u64 ino = b*psbi->inodes_per_block;
+	__u64 end = min_t(__u64,ino + psbi->inodes_per_block,
+				psbi->s_ps->psfs_nr_inodes);
+
+	while (ino < end) {
+		struct buffer_head *bh;
+		__u64 bit = ino & psbi->bits_per_block_mask;
+		__u64 n = min_t(__u64,end - ino,psbi->bits_per_block_mask + 1 - bit);
+
+		bh = psfs_bmap_bh(sb,PSFS_INODE_BMAP,
+				ino >> psbi->bits_per_block_shift);
+		/*Can't tell, leave it alone.*/
+		if (!bh)
+			return 1;
+		if (psfs_find_next_bit((unsigned char *)bh->b_data,bit + n,bit) <
+			bit + n)
+			return 1;
+		ino += n;
+	}
+	return 0;
+}
+
+/*
+ * Zero the slots of free inodes in inode table block b, bh being that
+ * block. Slots of allocated inodes are left alone. Called with
+ * s_itable_lock held, by the lazy init thread and by psfs_write_inode
+ * for blocks it gets to first.
+ */
+int psfs_itable_zero_free(struct super_block *sb,__u64 b,
+				struct buffer_head *bh)
+{
+	struct psfs_sb_info *psbi = PSFS_SB(sb);
+	struct psfs_inode *raw = (struct psfs_inode *)bh->b_data;
+	__u64 ino = b*psbi->inodes_per_block;
+	__u32 i;
+
+	lock_buffer(bh);
+	for (i = 0;i < psbi->inodes_per_block;i++,ino++) {
+		if (ino < psbi->s_ps->psfs_nr_inodes) {
+			struct buffer_head *bmap;
+			__u64 bit = ino & psbi->bits_per_block_mask;
+
+			bmap = psfs_bmap_bh(sb,PSFS_INODE_BMAP,
+					ino >> psbi->bits_per_block_shift);
+			if (!bmap) {
+				unlock_buffer(bh);
+				return -EIO;
+			}
+			if (bmap->b_data[bit >> 3] & (1 << (bit & 7)))
+				continue;
+		}
+		memset(&raw[i],0,sizeof(raw[i]));
+	}
+	unlock_buffer(bh);
+	mark_buffer_dirty(bh);
+	return 0;
+}
+
+/*
+ * Write the watermark to the on-disk superblock, dropping the lazy flag
+ * once the whole table is done. s_bh keeps the big endian copy.
+ */
+static void psfs_commit_itable(struct super_block *sb,__u64 zeroed)
+{
+	struct psfs_sb_info *psbi = PSFS_SB(sb);
+	struct psfs_super_block *raw;
+
+	raw = (struct psfs_super_block *)psbi->s_bh->b_data;
+	lock_buffer(psbi->s_bh);
+	raw->psfs_itable_zeroed = cpu_to_be64(zeroed);
+	if (zeroed >= psfs_itable_blocks(psbi)) {
+		psbi->s_ps->psfs_super_flags &= ~PSFS_SUPER_LAZY_ITABLE;
+		raw->psfs_super_flags = cpu_to_be32(psbi->s_ps->psfs_super_flags);
+	}
+	unlock_buffer(psbi->s_bh);
+	mark_buffer_dirty(psbi->s_bh);
+	sync_dirty_buffer(psbi->s_bh);
+}
+
+static int psfs_itable_thread(void *data)
+{
+	struct super_block *sb = data;
+	struct psfs_sb_info *psbi = PSFS_SB(sb);
+	struct buffer_head *batch[PSFS_ITABLE_BATCH];
+	__u64 nr = psfs_itable_blocks(psbi);
+	__u64 b = psbi->s_ps->psfs_itable_zeroed;
+	int i,n,err = 0;
+
+	while (!kthread_should_stop()) {
+		if (b >= nr || err) {
+			/*
+			 * Done, wait for umount. kthread_stop() may come
+			 * between the test above and the sleep, so check again
+			 * once we're set to be woken.
+			 */
+			set_current_state(TASK_INTERRUPTIBLE);
+			if (!kthread_should_stop())
+				schedule();
+			__set_current_state(TASK_RUNNING);
+			continue;
+		}
+		for (n = 0;n < PSFS_ITABLE_BATCH && b < nr;b++) {
+			struct buffer_head *bh;
+			mutex_lock(&psbi->s_itable_lock);
+			if (!psfs_itable_block_used(sb,b)) {
+				bh = sb_getblk(sb,psbi->inode_table_block + b);
+				lock_buffer(bh);
+				memset(bh->b_data,0,sb->s_blocksize);
+				set_buffer_uptodate(bh);
+				unlock_buffer(bh);
+				mark_buffer_dirty(bh);
+			}
+			else {
+				/*Live inodes in there, only clear the free slots.*/
+				bh = sb_bread(sb,psbi->inode_table_block + b);
+				if (!bh || psfs_itable_zero_free(sb,b,bh)) {
+					brelse(bh);
+					mutex_unlock(&psbi->s_itable_lock);
+					err = -EIO;
+					break;
+				}
+			}
+			batch[n++] = bh;
+			psbi->s_ps->psfs_itable_zeroed = b + 1;
+			mutex_unlock(&psbi->s_itable_lock);
+		}
+		for (i = 0;i < n;i++)
+			write_dirty_buffer(batch[i],WRITE);
+		for (i = 0;i < n;i++) {
+			wait_on_buffer(batch[i]);
+			if (!buffer_uptodate(batch[i]))
+				err = -EIO;
+			brelse(batch[i]);
+		}
+		if (err) {
+			printk(KERN_ERR "psfs: %s: error zeroing the inode table,"
+				" will retry at next mount\n",sb->s_id);
+			continue;
+		}
+		psfs_commit_itable(sb,b);
+		schedule_timeout_interruptible(PSFS_ITABLE_DELAY);
+	}
+	return 0;
+}
+static void psfs_put_super(struct super_block *sb)
+{
+	struct psfs_sb_info *psbi = PSFS_SB(sb);
+	if (!psbi)
+		return;
+	if (psbi->s_itable_task)
+		kthread_stop(psbi->s_itable_task);
+	psfs_sysfs_unregister(psbi);
+	percpu_counter_destroy(&psbi->s_dirty_blocks);
+	percpu_counter_destroy(&psbi->s_free_blocks);
+	percpu_counter_destroy(&psbi->s_free_inodes);
+	psfs_put_groups(sb);
+	psfs_destroy_bmap_cache(psbi);
+	brelse(psbi->s_bh);
+	kfree(psbi->s_ps);
+	kfree(psbi);
+	sb->s_fs_info = NULL;
+}
+
+/*
+ * Only reads the per-cpu counters, monitoring polls this on every mount.
+ * Blocks promised to delayed allocation count as used.
+ */
+static int psfs_statfs(struct dentry *dentry,struct kstatfs *buf)
+{
+	struct super_block *sb = dentry->d_sb;
+	struct psfs_sb_info *psbi = PSFS_SB(sb);
+	u64 id = huge_encode_dev(sb->s_bdev->bd_dev);
+	s64 free = percpu_counter_read_positive(&psbi->s_free_blocks) -
+		percpu_counter_read_positive(&psbi->s_dirty_blocks);
+
+	buf->f_type = PSFS_MAGIC;
+	buf->f_bsize = sb->s_blocksize;
+	buf->f_blocks = psbi->s_ps->psfs_nr_blocks;
+	buf->f_bfree = free > 0 ? free : 0;
+	buf->f_bavail = buf->f_bfree;
+	buf->f_files = psbi->s_ps->psfs_nr_inodes;
+	buf->f_ffree = percpu_counter_read_positive(&psbi->s_free_inodes);
+	buf->f_namelen = PSFS_FILENAME_LEN;
+	buf->f_fsid.val[0] = (u32)id;
+	buf->f_fsid.val[1] = (u32)(id >> 32);
+	return 0;
+}
+
 static const struct super_operations psfs_sops = {
-        /*.write_inode   = psfs_write_inode,
-        .delete_inode  = psfs_delete_inode,
-        .put_super     = psfs_put_super,*/
-	.statfs = simple_statfs,
+	.write_inode   = psfs_write_inode,
+        /*.delete_inode  = psfs_delete_inode,*/
+	.put_super     = psfs_put_super,
+	.statfs = psfs_statfs,
         .destroy_inode = psfs_destroy_inode,
 	.alloc_inode   =  psfs_get_inode	 
 };
@@ -69,8 +290,8 @@ static int psfs_fill_super(struct super_block *sb, void *data, int silent)
         struct psfs_super_block *ps;
         struct inode *root;
         struct buffer_head *bh = NULL;
-	struct psfs_inode_info *psi=NULL;
 	__u32 blocksize;
+	int64_t free_inodes;
         psbi = kzalloc(sizeof(*psbi), GFP_KERNEL);
         if(!psbi)
                 return -ENOMEM;
@@ -81,39 +302,51 @@ static int psfs_fill_super(struct super_block *sb, void *data, int silent)
                 printk("Unable to read superblock\n");
                 goto fail;
         }
-        ps = (struct psfs_super_block *)((char *)bh->b_data);
+        psbi->s_bh = bh;
+	ps = kmalloc(sizeof(*ps),GFP_KERNEL);
+	if (!ps)
+		goto cantfind_psfs;
+	memcpy(ps,bh->b_data,sizeof(*ps));
 	psfs_super_block_to_cpu(ps);
         psbi->s_ps = ps; 
-        psbi->s_bh = bh;
 	sb->s_magic = ps->psfs_magic;
-        if(sb->s_magic == (PSFS_MAGIC))
-		printk (KERN_INFO " Yah found PSFS file system\n");
-	else 
+        if(sb->s_magic != (PSFS_MAGIC))
 		goto cantfind_psfs;
 	
-	psfs_inode_bmp_block = get_inode_bmp_block(psbi,sb->s_blocksize);
-	psfs_data_bmp_block = get_data_bmp_block(psbi,sb->s_blocksize);
-	//psfs_inode_block = get_inode_block(psbi,sb->s_blocksize);
-	printk(KERN_INFO PSFS_DBG_VAR("%llx \n",psfs_inode_bmp_block));
+	psfs_init_geometry(sb);
+	mutex_init(&psbi->s_itable_lock);
+	if (!(ps->psfs_super_flags & PSFS_SUPER_LAZY_ITABLE))
+		ps->psfs_itable_zeroed = psfs_itable_blocks(psbi);
+	if (psfs_init_bmap_cache(sb))
+		goto cantfind_psfs;
+	if (psfs_load_groups(sb)) {
+		printk(KERN_ERR "psfs: unable to read allocation groups\n");
+		goto cantfind_psfs;
+	}
+	if (psfs_build_free_index(sb)) {
+		printk(KERN_ERR "psfs: unable to build free extent index\n");
+		goto cantfind_psfs;
+	}
+	free_inodes = psfs_count_free_inodes(sb);
+	if (free_inodes < 0) {
+		printk(KERN_ERR "psfs: unable to read the inode bitmap\n");
+		goto cantfind_psfs;
+	}
+	if (percpu_counter_init(&psbi->s_dirty_blocks,0) ||
+		percpu_counter_init(&psbi->s_free_blocks,
+				psfs_count_free_blocks(psbi)) ||
+		percpu_counter_init(&psbi->s_free_inodes,free_inodes))
+		goto cantfind_psfs;
+	if (psfs_sysfs_register(sb))
+		goto cantfind_psfs;
 		
         sb->s_op = &psfs_sops;
-        root = new_inode(sb);
-	if (!root)
-                goto cantfind_psfs;
-	/* psfs_read_inode is now moved out from the psfs_get_inode function 
-	 * to make psfs_get_inode function general for other call
-	 */
-	psi = PSFS_I(root);
-	if( !psfs_read_inode(root->i_sb,PSFS_ROOT_INODE,psi))
-        {
+	root = psfs_iget(sb,PSFS_ROOT_INODE);
+	if (IS_ERR(root)) {
                 printk(KERN_EMERG " cant read raw inode from disk\n");
-                return (-ENOMEM);
+                goto cantfind_psfs;
         }
-	psi->vfs_inode.i_fop = &psfs_fops;
-	psi->vfs_inode.i_op = &psfs_iops;
-	psi->vfs_inode.i_mode = S_IFDIR | 0755;
-	psi->vfs_inode.i_mtime = psi->vfs_inode.i_ctime = psi->vfs_inode.i_atime = CURRENT_TIME_SEC;
-	if (!S_ISDIR(psi->vfs_inode.i_mode)) {
+	if (!S_ISDIR(root->i_mode)) {
                 iput(root);
 		printk(KERN_EMERG "cant read the inode properly from the disk\n");
                 goto cantfind_psfs;
@@ -124,18 +357,36 @@ static int psfs_fill_super(struct super_block *sb, void *data, int silent)
 		iput(root);
 		goto cantfind_psfs;
 	}
-	printk(KERN_INFO PSFS_DBG_VAR("%ux \n",sb->s_dev));
-	printk(KERN_INFO PSFS_DBG_VAR("%lx \n",sb->s_blocksize));
-	printk(KERN_INFO PSFS_DBG_VAR("%x \n",sb->s_blocksize_bits));
-	printk(KERN_INFO PSFS_DBG_VAR("%x \n",ps->psfs_magic));
-	printk(KERN_INFO PSFS_DBG_VAR("%llx \n",ps->psfs_nr_blocks));
-	printk(KERN_INFO PSFS_DBG_VAR("%llx \n",ps->psfs_nr_inodes));
-	printk(KERN_INFO PSFS_DBG_VAR("%x \n",ps->psfs_boot_block));
-	printk(KERN_INFO PSFS_DBG_VAR("%x \n",ps->psfs_nr_boot_blocks));
+	if ((ps->psfs_super_flags & PSFS_SUPER_LAZY_ITABLE) &&
+		!(sb->s_flags & MS_RDONLY)) {
+		psbi->s_itable_task = kthread_run(psfs_itable_thread,sb,
+						"psfs_itable/%s",sb->s_id);
+		if (IS_ERR(psbi->s_itable_task)) {
+			printk(KERN_WARNING "psfs: %s: inode table stays"
+				" uninitialised\n",sb->s_id);
+			psbi->s_itable_task = NULL;
+		}
+	}
+	PSFS_DBG(PSFS_DEBUG_MOUNT,PSFS_DBG_VAR("%ux \n",sb->s_dev));
+	PSFS_DBG(PSFS_DEBUG_MOUNT,PSFS_DBG_VAR("%lx \n",sb->s_blocksize));
+	PSFS_DBG(PSFS_DEBUG_MOUNT,PSFS_DBG_VAR("%x \n",sb->s_blocksize_bits));
+	PSFS_DBG(PSFS_DEBUG_MOUNT,PSFS_DBG_VAR("%x \n",ps->psfs_magic));
+	PSFS_DBG(PSFS_DEBUG_MOUNT,PSFS_DBG_VAR("%llx \n",ps->psfs_nr_blocks));
+	PSFS_DBG(PSFS_DEBUG_MOUNT,PSFS_DBG_VAR("%llx \n",ps->psfs_nr_inodes));
+	PSFS_DBG(PSFS_DEBUG_MOUNT,PSFS_DBG_VAR("%x \n",ps->psfs_boot_block));
+	PSFS_DBG(PSFS_DEBUG_MOUNT,PSFS_DBG_VAR("%x \n",ps->psfs_nr_boot_blocks));
 	return 0;
 cantfind_psfs:
 	printk("Can't find the greatest file system so sad\n");
+	psfs_sysfs_unregister(psbi);
+	percpu_counter_destroy(&psbi->s_dirty_blocks);
+	percpu_counter_destroy(&psbi->s_free_blocks);
+	percpu_counter_destroy(&psbi->s_free_inodes);
+	psfs_destroy_free_index(psbi);
+	kfree(psbi->groups);
+	psfs_destroy_bmap_cache(psbi);
 	brelse(bh);
+	kfree(psbi->s_ps);
 	kfree(psbi);
 fail:
 	return -EINVAL;
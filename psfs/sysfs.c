@@ -0,0 +1,173 @@
+#define MODULE_OWNERSHIP
+#include "psfs.h"
+#include<linux/math64.h>
+
+/*
+ * Per mount statistics under /sys/fs/psfs/<dev>/.
+ *
+ * Counters are per cpu (see psfs_stat_inc) so the hot paths never share a
+ * cache line over them, reading a file sums them up across cpus.
+ */
+
+static struct kset *psfs_kset;
+
+struct psfs_stat_attr {
+	struct attribute attr;
+	int stat;
+	ssize_t (*show)(struct psfs_sb_info *psbi,int stat,char *buf);
+};
+
+static __u64 psfs_stat_sum(struct psfs_sb_info *psbi,int stat)
+{
+	__u64 sum = 0;
+	int cpu;
+	for_each_possible_cpu(cpu)
+		sum += per_cpu_ptr(psbi->s_stats,cpu)->count[stat];
+	return sum;
+}
+
+static ssize_t psfs_stat_show(struct psfs_sb_info *psbi,int stat,char *buf)
+{
+	return snprintf(buf,PAGE_SIZE,"%llu\n",
+			(unsigned long long)psfs_stat_sum(psbi,stat));
+}
+
+/*
+ * Average length of the extents handed out since mount, in blocks.
+ */
+static ssize_t psfs_avg_extent_show(struct psfs_sb_info *psbi,int stat,
+					char *buf)
+{
+	__u64 extents = psfs_stat_sum(psbi,PSFS_STAT_EXTENTS_ALLOCED);
+	__u64 blocks = psfs_stat_sum(psbi,PSFS_STAT_BLOCKS_ALLOCED);
+	return snprintf(buf,PAGE_SIZE,"%llu\n",
+			(unsigned long long)(extents ? div64_u64(blocks,extents) : 0));
+}
+
+/*
+ * Percentage of allocations that got less than they asked for because no
+ * free run was long enough, i.e. how fragmented free space is.
+ */
+static ssize_t psfs_fragmentation_show(struct psfs_sb_info *psbi,int stat,
+					char *buf)
+{
+	__u64 extents = psfs_stat_sum(psbi,PSFS_STAT_EXTENTS_ALLOCED);
+	__u64 partial = psfs_stat_sum(psbi,PSFS_STAT_PARTIAL_ALLOCS);
+	return snprintf(buf,PAGE_SIZE,"%llu\n",
+			(unsigned long long)(extents ?
+				div64_u64(partial * 100,extents) : 0));
+}
+
+#define PSFS_STAT_ATTR(_name,_stat,_show)			\
+static struct psfs_stat_attr psfs_attr_##_name = {		\
+	.attr = {.name = #_name,.mode = S_IRUGO},		\
+	.stat = _stat,						\
+	.show = _show,						\
+}
+#define PSFS_COUNTER_ATTR(_name,_stat)	PSFS_STAT_ATTR(_name,_stat,psfs_stat_show)
+
+PSFS_COUNTER_ATTR(inode_reads,PSFS_STAT_INODE_READS);
+PSFS_COUNTER_ATTR(icache_hits,PSFS_STAT_ICACHE_HITS);
+PSFS_COUNTER_ATTR(dcache_hits,PSFS_STAT_DCACHE_HITS);
+PSFS_COUNTER_ATTR(dirents_scanned,PSFS_STAT_DIRENTS_SCANNED);
+PSFS_COUNTER_ATTR(alloc_groups_scanned,PSFS_STAT_ALLOC_GROUPS_SCANNED);
+PSFS_COUNTER_ATTR(extents_alloced,PSFS_STAT_EXTENTS_ALLOCED);
+PSFS_COUNTER_ATTR(blocks_alloced,PSFS_STAT_BLOCKS_ALLOCED);
+PSFS_COUNTER_ATTR(partial_allocs,PSFS_STAT_PARTIAL_ALLOCS);
+PSFS_COUNTER_ATTR(extents_freed,PSFS_STAT_EXTENTS_FREED);
+PSFS_COUNTER_ATTR(blocks_freed,PSFS_STAT_BLOCKS_FREED);
+PSFS_COUNTER_ATTR(sync_meta_reads,PSFS_STAT_SYNC_META_READS);
+PSFS_COUNTER_ATTR(async_meta_reads,PSFS_STAT_ASYNC_META_READS);
+PSFS_STAT_ATTR(avg_extent_len,0,psfs_avg_extent_show);
+PSFS_STAT_ATTR(fragmentation,0,psfs_fragmentation_show);
+
+static struct attribute *psfs_stat_attrs[] = {
+	&psfs_attr_inode_reads.attr,
+	&psfs_attr_icache_hits.attr,
+	&psfs_attr_dcache_hits.attr,
+	&psfs_attr_dirents_scanned.attr,
+	&psfs_attr_alloc_groups_scanned.attr,
+	&psfs_attr_extents_alloced.attr,
+	&psfs_attr_blocks_alloced.attr,
+	&psfs_attr_partial_allocs.attr,
+	&psfs_attr_extents_freed.attr,
+	&psfs_attr_blocks_freed.attr,
+	&psfs_attr_sync_meta_reads.attr,
+	&psfs_attr_async_meta_reads.attr,
+	&psfs_attr_avg_extent_len.attr,
+	&psfs_attr_fragmentation.attr,
+	NULL,
+};
+
+static ssize_t psfs_attr_show(struct kobject *kobj,struct attribute *attr,
+				char *buf)
+{
+	struct psfs_sb_info *psbi = container_of(kobj,struct psfs_sb_info,s_kobj);
+	struct psfs_stat_attr *a = container_of(attr,struct psfs_stat_attr,attr);
+	return a->show(psbi,a->stat,buf);
+}
+
+static const struct sysfs_ops psfs_attr_ops = {
+	.show = psfs_attr_show,
+};
+
+static void psfs_sb_release(struct kobject *kobj)
+{
+	struct psfs_sb_info *psbi = container_of(kobj,struct psfs_sb_info,s_kobj);
+	complete(&psbi->s_kobj_unregister);
+}
+
+static struct kobj_type psfs_sb_ktype = {
+	.default_attrs = psfs_stat_attrs,
+	.sysfs_ops = &psfs_attr_ops,
+	.release = psfs_sb_release,
+};
+
+/*
+ * Set up the counters and the sysfs directory of a mount.
+ */
+int psfs_sysfs_register(struct super_block *sb)
+{
+	struct psfs_sb_info *psbi = PSFS_SB(sb);
+	int err;
+
+	psbi->s_stats = alloc_percpu(struct psfs_stats);
+	if (!psbi->s_stats)
+		return -ENOMEM;
+	init_completion(&psbi->s_kobj_unregister);
+	psbi->s_kobj.kset = psfs_kset;
+	err = kobject_init_and_add(&psbi->s_kobj,&psfs_sb_ktype,NULL,"%s",
+					sb->s_id);
+	if (err) {
+		kobject_put(&psbi->s_kobj);
+		wait_for_completion(&psbi->s_kobj_unregister);
+		free_percpu(psbi->s_stats);
+		psbi->s_stats = NULL;
+	}
+	return err;
+}
+
+/*
+ * Waits for sysfs readers to be done with psbi before freeing the
+ * counters.
+ */
+void psfs_sysfs_unregister(struct psfs_sb_info *psbi)
+{
+	if (!psbi->s_stats)
+		return;
+	kobject_put(&psbi->s_kobj);
+	wait_for_completion(&psbi->s_kobj_unregister);
+	free_percpu(psbi->s_stats);
+	psbi->s_stats = NULL;
+}
+
+int psfs_sysfs_init(void)
+{
+	psfs_kset = kset_create_and_add("psfs",NULL,fs_kobj);
+	return psfs_kset ? 0 : -ENOMEM;
+}
+
+void psfs_sysfs_exit(void)
+{
+	kset_unregister(psfs_kset);
+}
@@ -0,0 +1,234 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM psfs
+
+#if !defined(_TRACE_PSFS_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_PSFS_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * psfs tracepoints, under events/psfs/ in the tracing directory.
+ *
+ * Operations get an _enter event and an _exit event carrying the result
+ * and the time spent in ns (local_clock), so tail latency can be pinned
+ * on allocator scans or synchronous metadata reads. The module lives out
+ * of tree, the Makefile puts its directory on the include path so
+ * define_trace.h finds this file as <trace/events/psfs.h>.
+ */
+
+/*
+ * Timestamps for the _exit events, only taken while the event is on.
+ * A tracepoint switched on half way through an operation reports 0.
+ */
+#define psfs_trace_enabled(event)	unlikely(__tracepoint_##event.state)
+#define psfs_trace_clock(event)	(psfs_trace_enabled(event) ? local_clock() : 0)
+#define psfs_trace_delta(start)	((start) ? local_clock() - (start) : 0)
+
+DECLARE_EVENT_CLASS(psfs_op_enter,
+	TP_PROTO(struct inode *inode,__u64 arg),
+	TP_ARGS(inode,arg),
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned long,	ino)
+		__field(__u64,		arg)
+	),
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->arg = arg;
+	),
+	TP_printk("dev %d,%d ino %lu arg %llu",
+		MAJOR(__entry->dev),MINOR(__entry->dev),
+		__entry->ino,(unsigned long long)__entry->arg)
+);
+
+/*arg: 0*/
+DEFINE_EVENT(psfs_op_enter,psfs_lookup_enter,
+	TP_PROTO(struct inode *inode,__u64 arg),
+	TP_ARGS(inode,arg)
+);
+
+/*arg: f_pos*/
+DEFINE_EVENT(psfs_op_enter,psfs_readdir_enter,
+	TP_PROTO(struct inode *inode,__u64 arg),
+	TP_ARGS(inode,arg)
+);
+
+/*arg: 0*/
+DEFINE_EVENT(psfs_op_enter,psfs_read_inode_enter,
+	TP_PROTO(struct inode *inode,__u64 arg),
+	TP_ARGS(inode,arg)
+);
+
+/*arg: logical block*/
+DEFINE_EVENT(psfs_op_enter,psfs_map_block_enter,
+	TP_PROTO(struct inode *inode,__u64 arg),
+	TP_ARGS(inode,arg)
+);
+
+TRACE_EVENT(psfs_lookup_exit,
+	TP_PROTO(struct inode *dir,const char *name,__u32 ino,int ret,
+		__u64 elapsed),
+	TP_ARGS(dir,name,ino,ret,elapsed),
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned long,	dir)
+		__string(name,		name)
+		__field(__u32,		ino)
+		__field(int,		ret)
+		__field(__u64,		elapsed)
+	),
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__assign_str(name,name);
+		__entry->ino = ino;
+		__entry->ret = ret;
+		__entry->elapsed = elapsed;
+	),
+	TP_printk("dev %d,%d dir %lu name %s ino %u ret %d elapsed %llu",
+		MAJOR(__entry->dev),MINOR(__entry->dev),__entry->dir,
+		__get_str(name),__entry->ino,__entry->ret,
+		(unsigned long long)__entry->elapsed)
+);
+
+TRACE_EVENT(psfs_readdir_exit,
+	TP_PROTO(struct inode *dir,loff_t pos,int ret,__u64 elapsed),
+	TP_ARGS(dir,pos,ret,elapsed),
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned long,	ino)
+		__field(loff_t,		pos)
+		__field(int,		ret)
+		__field(__u64,		elapsed)
+	),
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->ino = dir->i_ino;
+		__entry->pos = pos;
+		__entry->ret = ret;
+		__entry->elapsed = elapsed;
+	),
+	TP_printk("dev %d,%d ino %lu pos %lld ret %d elapsed %llu",
+		MAJOR(__entry->dev),MINOR(__entry->dev),__entry->ino,
+		__entry->pos,__entry->ret,(unsigned long long)__entry->elapsed)
+);
+
+TRACE_EVENT(psfs_read_inode_exit,
+	TP_PROTO(struct inode *inode,sector_t pblk,int ret,__u64 elapsed),
+	TP_ARGS(inode,pblk,ret,elapsed),
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned long,	ino)
+		__field(sector_t,	pblk)
+		__field(int,		ret)
+		__field(__u64,		elapsed)
+	),
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->pblk = pblk;
+		__entry->ret = ret;
+		__entry->elapsed = elapsed;
+	),
+	TP_printk("dev %d,%d ino %lu table block %llu ret %d elapsed %llu",
+		MAJOR(__entry->dev),MINOR(__entry->dev),__entry->ino,
+		(unsigned long long)__entry->pblk,__entry->ret,
+		(unsigned long long)__entry->elapsed)
+);
+
+TRACE_EVENT(psfs_map_block_exit,
+	TP_PROTO(struct inode *inode,sector_t lblk,sector_t pblk,
+		unsigned long len,int ret,__u64 elapsed),
+	TP_ARGS(inode,lblk,pblk,len,ret,elapsed),
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned long,	ino)
+		__field(sector_t,	lblk)
+		__field(sector_t,	pblk)
+		__field(unsigned long,	len)
+		__field(int,		ret)
+		__field(__u64,		elapsed)
+	),
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->lblk = lblk;
+		__entry->pblk = pblk;
+		__entry->len = len;
+		__entry->ret = ret;
+		__entry->elapsed = elapsed;
+	),
+	TP_printk("dev %d,%d ino %lu lblk %llu pblk %llu len %lu ret %d elapsed %llu",
+		MAJOR(__entry->dev),MINOR(__entry->dev),__entry->ino,
+		(unsigned long long)__entry->lblk,
+		(unsigned long long)__entry->pblk,__entry->len,__entry->ret,
+		(unsigned long long)__entry->elapsed)
+);
+
+/*
+ * One allocator call made to extend a file: @lblk is where the new blocks
+ * go in the file, @wanted what was asked for, pblk/len what came back.
+ */
+TRACE_EVENT(psfs_alloc_extent,
+	TP_PROTO(struct inode *inode,__u64 lblk,__u64 wanted,__u32 pblk,
+		__u32 len,int ret,__u64 elapsed),
+	TP_ARGS(inode,lblk,wanted,pblk,len,ret,elapsed),
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned long,	ino)
+		__field(__u64,		lblk)
+		__field(__u64,		wanted)
+		__field(__u32,		pblk)
+		__field(__u32,		len)
+		__field(int,		ret)
+		__field(__u64,		elapsed)
+	),
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->lblk = lblk;
+		__entry->wanted = wanted;
+		__entry->pblk = pblk;
+		__entry->len = len;
+		__entry->ret = ret;
+		__entry->elapsed = elapsed;
+	),
+	TP_printk("dev %d,%d ino %lu lblk %llu wanted %llu pblk %u len %u ret %d elapsed %llu",
+		MAJOR(__entry->dev),MINOR(__entry->dev),__entry->ino,
+		(unsigned long long)__entry->lblk,
+		(unsigned long long)__entry->wanted,__entry->pblk,
+		__entry->len,__entry->ret,(unsigned long long)__entry->elapsed)
+);
+
+TRACE_EVENT(psfs_free_extent,
+	TP_PROTO(struct super_block *sb,__u64 pblk,__u64 len,int ret,
+		__u64 elapsed),
+	TP_ARGS(sb,pblk,len,ret,elapsed),
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(__u64,		pblk)
+		__field(__u64,		len)
+		__field(int,		ret)
+		__field(__u64,		elapsed)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->pblk = pblk;
+		__entry->len = len;
+		__entry->ret = ret;
+		__entry->elapsed = elapsed;
+	),
+	TP_printk("dev %d,%d pblk %llu len %llu ret %d elapsed %llu",
+		MAJOR(__entry->dev),MINOR(__entry->dev),
+		(unsigned long long)__entry->pblk,
+		(unsigned long long)__entry->len,__entry->ret,
+		(unsigned long long)__entry->elapsed)
+);
+
+#endif /*_TRACE_PSFS_H*/
+
+/*Out of tree, see above.*/
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH trace/events
+#include <trace/define_trace.h>